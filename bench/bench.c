@@ -0,0 +1,642 @@
+/* headless benchmark: kilo is run on a pseudo terminal of a given size, opens generated files
+and is fed recorded keystroke scripts one key at a time. for every script and file it reports
+the time from handing a key in to the editor waiting for the next one (p50/p99/max), the bytes
+editorRefreshScreen() wrote for it and the peak RSS of the run. then every file is
+highlighted whole, as C, for the highlighter's and the comment state scan's MB/s, and loaded
+again for the GB/s of editorSplitRows() on the file in memory and of editorLoadStream() reading it,
+next to the getline() loop kilo used to open files with (a malloc'd copy of every line).
+
+    make bench
+    bench/kilo-bench [-s ROWSxCOLS] [-d DIR] [-m MB] [-o OUT] [-b BASE] [-t PCT] script.keys...
+
+-d is where the files are generated (kept between runs), -m runs kilo with -m MB, -o writes the
+results as tab separated lines and -b compares against such a file: a run more than PCT percent
+(default 20) worse in p99, bytes per frame, RSS or any MB/s is marked and the exit status is 1.
+
+a script has one "COUNT KEYS" per line, # starts a comment. KEYS are typed COUNT times, \e \r
+\t \\ and \xHH are escapes. an escape sequence is one key, a bracketed paste from \e[200~ to
+\e[201~ too. scripts should not press Ctrl-S: the generated files are shared by every run. */
+
+/* ***includes*** */
+void benchIdle();
+void benchLex();
+void benchLoad();
+#define KILO_IDLE() benchIdle()
+#define main kilo_main
+#include "../kilo.c"
+#undef main
+#include<sys/wait.h>
+
+/* ***data*** */
+#define BENCH_MB (1LL<<20)
+#define BENCH_LEX_PASSES 5
+#define BENCH_LOAD_PASSES 3
+#define BENCH_KEYS 0    /* what a child run measures */
+#define BENCH_LEX 1
+#define BENCH_LOAD 2
+typedef struct benchResult{
+    int keys;
+    long long open_us;/* from starting kilo to its first wait for a key, file fully loaded */
+    long long p50_us;
+    long long p99_us;
+    long long max_us;
+    long long frame_avg;/* bytes per editorRefreshScreen() */
+    int frame_max;
+    long long rss_kb;
+}benchResult;
+typedef struct benchLexResult{
+    long long bytes;/* rendered bytes highlighted in a pass */
+    double hl_mbs;/* editorSyntaxFrom() over every row, best pass */
+    double scan_mbs;/* editorSyntaxScan(), the comment state walk, best pass */
+}benchLexResult;
+typedef struct benchLoadResult{
+    long long bytes;
+    double split_mbs;/* editorSplitRows() over the file in memory, best pass */
+    double stream_mbs;/* editorLoadStream() reading the file, from the page cache, best pass */
+    double getline_mbs;/* getline() and a malloc'd row per line, the way kilo opened files before */
+}benchLoadResult;
+typedef struct benchRow{/* a line of a -b baseline */
+    char script[64];
+    char corpus[64];
+    benchResult r;
+}benchRow;
+typedef struct benchRate{/* a "rate" line of a -b baseline, a throughput */
+    char what[32];
+    char corpus[64];
+    double mbs;
+}benchRate;
+struct benchState{
+    char* bytes;/* the keys of the script, back to back */
+    int* key;/* key i is bytes[key[i]]..bytes[key[i+1]] */
+    int nkeys;
+    int next;/* key being handed in */
+    int fed;/* bytes of it the editor has been given */
+    int started;
+    long long start;
+    long long open_us;
+    long long sent;
+    long long* lat;
+    long long frame_total;
+    int frame_max;
+    int report;/* results go back to the parent through this pipe */
+    int what;/* BENCH_KEYS, or time the highlighter or the loader over the whole file */
+    unsigned seed;
+}B;
+
+/* ***timing*** */
+long long benchNs(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec*1000000000LL+ts.tv_nsec;
+}
+int benchCmp(const void* a,const void* b){
+    long long x=*(const long long*)a,y=*(const long long*)b;
+    return x<y ? -1 : x>y;
+}
+long long benchPercentile(long long* v,int n,int pct){/* nearest rank, v sorted */
+    if(n==0) return 0;
+    int i=(int)(((long long)n*pct+99)/100)-1;
+    return v[i<0 ? 0 : i];
+}
+void benchReport(){
+    benchResult r;
+    memset(&r,0,sizeof(r));
+    int n=B.nkeys;
+    qsort(B.lat,n,sizeof(long long),benchCmp);
+    r.keys=n;
+    r.open_us=B.open_us;
+    r.p50_us=benchPercentile(B.lat,n,50)/1000;
+    r.p99_us=benchPercentile(B.lat,n,99)/1000;
+    r.max_us=n ? B.lat[n-1]/1000 : 0;
+    r.frame_avg=n ? B.frame_total/n : 0;
+    r.frame_max=B.frame_max;
+    write(B.report,&r,sizeof(r));
+}
+
+/* ***highlighting*** */
+void benchLex(){
+    /* every row highlighted from scratch, and the multiline comment scan a walk to a far row
+    does, each timed over the whole file. a file with no syntax of its own is lexed as C */
+    if(E.syntax==NULL) E.syntax=&HLDB[0];
+    benchLexResult r;
+    r.bytes=0;
+    long long chars=0;
+    for(int j=0;j<E.numrows;j++){
+        erow* row=editorRowAt(j);
+        if(!(row->flags & ROW_RENDER_VALID)) editorUpdateRender(row);
+        row->hl=realloc(row->hl,row->rsize ? row->rsize : 1);
+        r.bytes+=row->rsize;
+        chars+=row->size;
+    }
+    long long best_hl=0,best_scan=0;
+    for(int pass=0;pass<BENCH_LEX_PASSES;pass++){
+        long long t=benchNs();
+        int state=0;
+        for(int j=0;j<E.numrows;j++){
+            erow* row=editorRowAt(j);
+            row->flags=(row->flags & ~ROW_IN_COMMENT) | (state ? ROW_IN_COMMENT : 0);
+            editorSyntaxFrom(j,0,row->rsize);
+            state=row->hl_open_comment;
+        }
+        t=benchNs()-t;
+        if(!best_hl || t<best_hl) best_hl=t;
+        t=benchNs();
+        state=0;
+        for(int j=0;j<E.numrows;j++){
+            erow* row=editorRowAt(j);
+            state=editorSyntaxScan(editorRowChars(row),row->size,state);
+        }
+        t=benchNs()-t;
+        if(!best_scan || t<best_scan) best_scan=t;
+    }
+    r.hl_mbs=r.bytes/(double)BENCH_MB/(best_hl/1e9);
+    r.scan_mbs=chars/(double)BENCH_MB/(best_scan/1e9);
+    write(B.report,&r,sizeof(r));
+}
+
+/* ***loading*** */
+void benchLoad(){
+    /* the file again, split into rows from memory with one leaf reused, so only the split
+    is timed, read in by editorLoadStream() as a pipe would be, page cache warm, and read with
+    getline() into a row array for reference */
+    benchLoadResult r;
+    char* path=E.filename;
+    int fd=open(path,O_RDONLY);
+    struct stat st;
+    if(fd==-1 || fstat(fd,&st)==-1) die("open");
+    r.bytes=st.st_size;
+    char* buf=malloc(r.bytes+1);
+    long long got=0;
+    while(got<r.bytes){
+        ssize_t n=read(fd,buf+got,r.bytes-got);
+        if(n<=0) die("read");
+        got+=n;
+    }
+    close(fd);
+    ropeNode* leaf=ropeNewNode(1);
+    long long best_split=0,best_stream=0;
+    long long rows=0;
+    for(int pass=0;pass<BENCH_LOAD_PASSES;pass++){
+        long long t=benchNs();
+        char* p=buf;
+        char* end=buf+r.bytes;
+        rows=0;
+        while(p<end){
+            leaf->n=0;
+            p=editorSplitRows(leaf,p,end,1);
+            rows+=leaf->n;
+        }
+        t=benchNs()-t;
+        if(!best_split || t<best_split) best_split=t;
+    }
+    for(int pass=0;pass<BENCH_LOAD_PASSES;pass++){
+        E.rows=ropeNewNode(1);/* the last pass's rows are left be, this is a throwaway child */
+        E.numrows=0;
+        fd=open(path,O_RDONLY);
+        if(fd==-1) die("open");
+        long long t=benchNs();
+        editorLoadStream(fd);
+        t=benchNs()-t;
+        if(E.numrows!=rows) die("editorLoadStream");/* both have to agree on the lines */
+        if(!best_stream || t<best_stream) best_stream=t;
+    }
+    long long best_getline=0;
+    for(int pass=0;pass<BENCH_LOAD_PASSES;pass++){
+        FILE* fp=fopen(path,"r");
+        if(!fp) die("fopen");
+        char** line=NULL;
+        long long n=0,cap=0;
+        char* text=NULL;
+        size_t linecap=0;
+        ssize_t linelen;
+        long long t=benchNs();
+        while((linelen=getline(&text,&linecap,fp))!=-1){
+            while(linelen>0 && (text[linelen-1]=='\n' || text[linelen-1]=='\r')) linelen--;
+            if(n==cap) line=realloc(line,sizeof(char*)*(cap=cap ? cap*2 : 1024));
+            line[n]=malloc(linelen+1);
+            memcpy(line[n],text,linelen);
+            line[n++][linelen]='\0';
+        }
+        t=benchNs()-t;
+        fclose(fp);
+        if(n!=rows) die("getline");
+        if(!best_getline || t<best_getline) best_getline=t;
+        while(n>0) free(line[--n]);
+        free(line);
+        free(text);
+    }
+    r.split_mbs=r.bytes/(double)BENCH_MB/(best_split/1e9);
+    r.stream_mbs=r.bytes/(double)BENCH_MB/(best_stream/1e9);
+    r.getline_mbs=r.bytes/(double)BENCH_MB/(best_getline/1e9);
+    write(B.report,&r,sizeof(r));
+}
+
+/* ***feeding keys*** */
+void benchIdle(){
+    /* kilo is about to wait for input: everything handed in so far is handled and drawn */
+    long long now=benchNs();
+    if(!B.started){
+        B.started=1;
+        editorLoadFinish();/* keys are timed against the whole file */
+        editorLoadScan();
+        editorRefreshScreen();
+        B.open_us=(benchNs()-B.start)/1000;
+        if(B.what==BENCH_LEX) benchLex();
+        if(B.what==BENCH_LOAD) benchLoad();
+        if(B.what!=BENCH_KEYS) exit(0);
+    }else if(B.fed==B.key[B.next+1]-B.key[B.next]){
+        B.lat[B.next]=now-B.sent;
+        B.frame_total+=E.frame_bytes;
+        if(E.frame_bytes>B.frame_max) B.frame_max=E.frame_bytes;
+        B.next++;
+        B.fed=0;
+    }
+    if(B.next==B.nkeys){
+        benchReport();
+        exit(0);
+    }
+    /* a key longer than the input buffer (a big paste) goes in a buffer at a time */
+    int n=B.key[B.next+1]-B.key[B.next]-B.fed;
+    if(n>(int)sizeof(E.inbuf)) n=sizeof(E.inbuf);
+    if(B.fed==0) B.sent=benchNs();
+    memcpy(E.inbuf,&B.bytes[B.key[B.next]+B.fed],n);
+    E.inpos=0;
+    E.inlen=n;
+    B.fed+=n;
+}
+void* benchDrain(void* arg){/* the terminal side: whatever kilo draws is thrown away */
+    int fd=*(int*)arg;
+    char buf[65536];
+    while(read(fd,buf,sizeof(buf))>0);
+    return NULL;
+}
+void benchRun(char* corpus,int rows,int cols,char* mb){
+    /* in the child: kilo gets a pseudo terminal of rows x cols as stdin and stdout */
+    int master=posix_openpt(O_RDWR|O_NOCTTY);
+    if(master==-1 || grantpt(master)==-1 || unlockpt(master)==-1) die("posix_openpt");
+    int slave=open(ptsname(master),O_RDWR|O_NOCTTY);
+    if(slave==-1) die("ptsname");
+    struct winsize ws={rows,cols,0,0};
+    if(ioctl(slave,TIOCSWINSZ,&ws)==-1) die("TIOCSWINSZ");
+    dup2(slave,STDIN_FILENO);
+    dup2(slave,STDOUT_FILENO);
+    close(slave);
+    pthread_t drain;
+    pthread_create(&drain,NULL,benchDrain,&master);
+    char* argv[5]={"kilo",corpus,NULL,NULL,NULL};
+    if(mb){
+        argv[1]="-m";
+        argv[2]=mb;
+        argv[3]=corpus;
+    }
+    B.start=benchNs();
+    kilo_main(mb ? 4 : 2,argv);
+}
+
+/* ***scripts*** */
+int benchKeyLen(char* p,int n){
+    /* bytes of the key starting at p: an escape sequence runs to its final byte, a paste to
+    its end marker */
+    if(p[0]!='\x1b' || n<2 || p[1]!='[') return 1;
+    int i=2;
+    while(i<n && !(p[i]>=0x40 && p[i]<=0x7e)) i++;
+    if(i==n) return n;
+    if(i==5 && !memcmp(p,"\x1b[200~",6)){
+        char* end=memmem(p,n,"\x1b[201~",6);
+        return end ? end-p+6 : n;
+    }
+    return i+1;
+}
+int benchUnescape(char* s,char* out){
+    int n=0;
+    while(*s){
+        if(*s!='\\' || !s[1]){
+            out[n++]=*s++;
+            continue;
+        }
+        s++;
+        switch(*s){
+            case 'e': out[n++]='\x1b';break;
+            case 'r': out[n++]='\r';break;
+            case 't': out[n++]='\t';break;
+            case 'x':{
+                char hex[3]={s[1],s[1] ? s[2] : 0,0};
+                out[n++]=(char)strtol(hex,NULL,16);
+                s+=s[1] && s[2] ? 2 : strlen(s)-1;
+                break;
+            }
+            default: out[n++]=*s;break;
+        }
+        s++;
+    }
+    return n;
+}
+void benchLoadScript(char* path){
+    FILE* fp=fopen(path,"r");
+    if(!fp){
+        perror(path);
+        exit(1);
+    }
+    int cap=4096,len=0,kcap=1024;
+    B.bytes=malloc(cap);
+    B.key=malloc(sizeof(int)*kcap);
+    B.nkeys=0;
+    char* line=NULL;
+    size_t linecap=0;
+    ssize_t linelen;
+    while((linelen=getline(&line,&linecap,fp))!=-1){
+        while(linelen>0 && (line[linelen-1]=='\n' || line[linelen-1]=='\r')) line[--linelen]=0;
+        if(line[0]=='#' || line[0]==0) continue;
+        char* keys;
+        long count=strtol(line,&keys,10);
+        if(keys==line || *keys!=' '){
+            fprintf(stderr,"%s: expected \"COUNT KEYS\": %s\n",path,line);
+            exit(1);
+        }
+        keys++;
+        char* one=malloc(linelen+1);
+        int n=benchUnescape(keys,one);
+        for(long c=0;c<count;c++){
+            for(int i=0;i<n;){
+                int k=benchKeyLen(&one[i],n-i);
+                while(len+k>cap) cap*=2;
+                B.bytes=realloc(B.bytes,cap);
+                if(B.nkeys+2>kcap) B.key=realloc(B.key,sizeof(int)*(kcap*=2));
+                B.key[B.nkeys++]=len;
+                memcpy(&B.bytes[len],&one[i],k);
+                len+=k;
+                i+=k;
+            }
+        }
+        free(one);
+    }
+    B.key[B.nkeys]=len;
+    free(line);
+    fclose(fp);
+    B.lat=malloc(sizeof(long long)*(B.nkeys+1));
+}
+
+/* ***corpora*** */
+char* benchWords[]={"int","char","len","buf","row","count","size","next","prev","node","key",
+    "value","table","index","state","flags","offset","line","cursor","screen","match","query"};
+char* benchWord(){
+    B.seed=B.seed*1103515245+12345;
+    return benchWords[(B.seed>>16)%(sizeof(benchWords)/sizeof(benchWords[0]))];
+}
+int benchRand(int n){
+    B.seed=B.seed*1103515245+12345;
+    return (B.seed>>16)%n;
+}
+void benchCode(FILE* fp,long long size,int tab,int comment){
+    /* C-looking functions until size bytes: tab indents with tabs and lines trailing
+    comments up with them, comment turns about half of the text into comments */
+    long long n=0;
+    int f=0;
+    while(n<size){
+        if(comment){
+            char* a=benchWord();
+            char* b=benchWord();
+            n+=fprintf(fp,"/*\n * %s: %s the %s of %s.\n *\n * %s: a \"/*\" in here does not nest\n */\n",
+                a,b,benchWord(),benchWord(),benchWord());
+        }
+        char* name=benchWord();
+        n+=fprintf(fp,"static int %s_%d(char* %s, int %s){\n",name,f++,benchWord(),benchWord());
+        int depth=1;
+        for(int i=0;i<24 || depth>1;i++){
+            int kind=benchRand(6);
+            if(kind==2 && depth==1) kind=0;
+            if(kind==1 && depth==4) kind=0;
+            if(i>=24) kind=2;
+            int d=kind==2 ? depth-1 : depth;
+            for(int j=0;j<d;j++) n+=tab ? fprintf(fp,"\t") : fprintf(fp,"    ");
+            char* a=benchWord();
+            char* b=benchWord();
+            switch(kind){
+                case 0: n+=fprintf(fp,"%s = %s + %d;\n",a,b,benchRand(1000));break;
+                case 1: n+=fprintf(fp,"if (%s < %d) {\n",a,benchRand(100));depth++;break;
+                case 2: n+=fprintf(fp,"}\n");depth--;break;
+                case 3: n+=fprintf(fp,"%s(%s, \"%s /* %%d */\\n\", %d);\n",a,b,benchWord(),benchRand(64));break;
+                case 4:
+                    if(comment) n+=fprintf(fp,"// %s %s, then %s it again\n",a,b,benchWord());
+                    else n+=fprintf(fp,"%s++;\n",a);
+                    break;
+                default:
+                    if(tab) n+=fprintf(fp,"%s = %s;\t\t/* %s */\n",a,b,benchWord());
+                    else if(comment) n+=fprintf(fp,"%s = '%c'; /* %s\n%*s   %s */\n",a,'a'+benchRand(26),b,d*4,"",benchWord());
+                    else n+=fprintf(fp,"return %s;\n",a);
+                    break;
+            }
+        }
+        n+=fprintf(fp,"}\n\n");
+    }
+}
+void benchLong(FILE* fp,int lines,long long width){/* lines of words width bytes long */
+    for(int i=0;i<lines;i++){
+        long long n=0;
+        while(n<width) n+=fprintf(fp,"%s%c",benchWord(),benchRand(16) ? ' ' : '\t');
+        fputc('\n',fp);
+    }
+}
+void benchCorpus(char* dir,char* name,int kind,char* path){
+    /* each file is made once and reused, so runs are comparable */
+    snprintf(path,1024,"%s/%s",dir,name);
+    struct stat st;
+    if(stat(path,&st)==0 && st.st_size>0) return;
+    FILE* fp=fopen(path,"w");
+    if(!fp){
+        perror(path);
+        exit(1);
+    }
+    fprintf(stderr,"generating %s\n",path);
+    B.seed=kind+1;
+    switch(kind){
+        case 0: benchCode(fp,64*BENCH_MB,0,0);break;/* huge */
+        case 1: benchLong(fp,48,256*1024);break;/* long lines */
+        case 2: benchCode(fp,8*BENCH_MB,1,0);break;/* tab heavy */
+        case 3: benchCode(fp,8*BENCH_MB,0,1);break;/* comment heavy */
+    }
+    fclose(fp);
+}
+
+/* ***results*** */
+char* benchBase(char* path){
+    char* s=strrchr(path,'/');
+    return s ? s+1 : path;
+}
+int benchWorse(long long now,long long base,int pct,long long floor){
+    return now-base>floor && now*100>base*(100+pct);
+}
+int benchCompare(benchRow* base,int nbase,char* script,char* corpus,benchResult* r,int pct,char* note){
+    /* what got worse than the baseline, "" if nothing */
+    note[0]=0;
+    for(int i=0;i<nbase;i++){
+        if(strcmp(base[i].script,script) || strcmp(base[i].corpus,corpus)) continue;
+        benchResult* b=&base[i].r;
+        if(benchWorse(r->p99_us,b->p99_us,pct,100)) strcat(note," p99");
+        if(benchWorse(r->frame_avg,b->frame_avg,pct,64)) strcat(note," frame");
+        if(benchWorse(r->rss_kb,b->rss_kb,pct,1024)) strcat(note," rss");
+        return note[0]!=0;
+    }
+    return 0;
+}
+int benchCompareRate(benchRate* base,int nbase,char* what,char* corpus,double mbs,int pct,char* note){
+    /* a throughput is worse when it dropped by more than pct percent */
+    note[0]=0;
+    for(int i=0;i<nbase;i++){
+        if(strcmp(base[i].what,what) || strcmp(base[i].corpus,corpus)) continue;
+        if(mbs*100<base[i].mbs*(100-pct)) sprintf(note," %s",what);
+        return note[0]!=0;
+    }
+    return 0;
+}
+int benchReadBase(char* path,benchRow** rows,benchRate** rates,int* nrates){
+    /* key runs are ten fields a line, throughputs "rate WHAT FILE MB/s" */
+    FILE* fp=fopen(path,"r");
+    if(!fp){
+        perror(path);
+        exit(1);
+    }
+    int n=0,cap=16,rcap=16;
+    *rows=malloc(sizeof(benchRow)*cap);
+    *rates=malloc(sizeof(benchRate)*rcap);
+    *nrates=0;
+    benchRow r;
+    benchRate rate;
+    char line[512];
+    while(fgets(line,sizeof(line),fp)){
+        if(sscanf(line,"rate %31s %63s %lf",rate.what,rate.corpus,&rate.mbs)==3){
+            if(*nrates==rcap) *rates=realloc(*rates,sizeof(benchRate)*(rcap*=2));
+            (*rates)[(*nrates)++]=rate;
+            continue;
+        }
+        if(sscanf(line,"%63s %63s %d %lld %lld %lld %lld %lld %d %lld",r.script,r.corpus,&r.r.keys,
+            &r.r.open_us,&r.r.p50_us,&r.r.p99_us,&r.r.max_us,&r.r.frame_avg,&r.r.frame_max,&r.r.rss_kb)!=10) continue;
+        if(n==cap) *rows=realloc(*rows,sizeof(benchRow)*(cap*=2));
+        (*rows)[n++]=r;
+    }
+    fclose(fp);
+    return n;
+}
+
+int benchSpawn(int what,char* script,char* corpus,int rows,int cols,char* mb,void* res,int size,struct rusage* ru){
+    /* one run in a child of its own, so each gets a fresh kilo and its own peak RSS. 1 if
+    the child reported back */
+    int fd[2];
+    if(pipe(fd)==-1) die("pipe");
+    fflush(stdout);
+    pid_t pid=fork();
+    if(pid==-1) die("fork");
+    if(pid==0){
+        close(fd[0]);
+        B.report=fd[1];
+        B.what=what;
+        if(what==BENCH_KEYS) benchLoadScript(script);
+        benchRun(corpus,rows,cols,mb);
+        exit(1);/* kilo_main() returned: the script ran into Ctrl-Q */
+    }
+    close(fd[1]);
+    int got=read(fd[0],res,size);
+    close(fd[0]);
+    int status;
+    wait4(pid,&status,0,ru);
+    return got==size;
+}
+
+/* ***main*** */
+int main(int argc,char* argv[]){
+    int rows=40,cols=120,pct=20,opt;
+    char* dir="bench/corpus";
+    char* mb=NULL;
+    char* out=NULL;
+    char* basepath=NULL;
+    while((opt=getopt(argc,argv,"s:d:m:o:b:t:"))!=-1){
+        switch(opt){
+            case 's':
+                if(sscanf(optarg,"%dx%d",&rows,&cols)!=2 || rows<3 || cols<1){
+                    fprintf(stderr,"-s wants ROWSxCOLS\n");
+                    return 1;
+                }
+                break;
+            case 'd': dir=optarg;break;
+            case 'm': mb=optarg;break;
+            case 'o': out=optarg;break;
+            case 'b': basepath=optarg;break;
+            case 't': pct=atoi(optarg);break;
+            default:
+                fprintf(stderr,"usage: %s [-s ROWSxCOLS] [-d DIR] [-m MB] [-o OUT] [-b BASE] [-t PCT] script.keys...\n",argv[0]);
+                return 1;
+        }
+    }
+    if(optind==argc){
+        fprintf(stderr,"%s: no scripts\n",argv[0]);
+        return 1;
+    }
+    mkdir(dir,0755);
+    char* names[]={"huge.c","longlines.txt","tabs.c","comments.c"};
+    char corpus[4][1024];
+    for(int i=0;i<4;i++) benchCorpus(dir,names[i],i,corpus[i]);
+    benchRow* base=NULL;
+    benchRate* rates=NULL;
+    int nrates=0;
+    int nbase=basepath ? benchReadBase(basepath,&base,&rates,&nrates) : 0;
+    FILE* fout=out ? fopen(out,"w") : NULL;
+    if(out && !fout){
+        perror(out);
+        return 1;
+    }
+
+    printf("kilo bench, %dx%d terminal%s%s\n",rows,cols,mb ? ", -m " : "",mb ? mb : "");
+    printf("%-14s %-14s %6s %9s %8s %8s %8s %9s %8s %9s\n","script","file","keys",
+        "open ms","p50 us","p99 us","max us","B/frame","max B","peak RSS");
+    int worse=0;
+    for(int s=optind;s<argc;s++){
+        for(int c=0;c<4;c++){
+            benchResult r;
+            struct rusage ru;
+            char* script=benchBase(argv[s]);
+            if(!benchSpawn(BENCH_KEYS,argv[s],corpus[c],rows,cols,mb,&r,sizeof(r),&ru)){
+                printf("%-14s %-14s failed\n",script,names[c]);
+                worse=1;
+                continue;
+            }
+            r.rss_kb=ru.ru_maxrss;
+            char note[32];
+            worse|=benchCompare(base,nbase,script,names[c],&r,pct,note);
+            printf("%-14s %-14s %6d %9.1f %8lld %8lld %8lld %9lld %8d %6.1f MB%s%s\n",script,names[c],
+                r.keys,r.open_us/1000.0,r.p50_us,r.p99_us,r.max_us,r.frame_avg,r.frame_max,
+                r.rss_kb/1024.0,note[0] ? "  worse:" : "",note);
+            if(fout) fprintf(fout,"%s\t%s\t%d\t%lld\t%lld\t%lld\t%lld\t%lld\t%d\t%lld\n",script,names[c],
+                r.keys,r.open_us,r.p50_us,r.p99_us,r.max_us,r.frame_avg,r.frame_max,r.rss_kb);
+        }
+    }
+
+    printf("\n%-14s %8s %10s %10s %11s %11s %12s\n","file","MB","hl MB/s","scan MB/s","split GB/s",
+        "stream GB/s","getline GB/s");
+    for(int c=0;c<4;c++){
+        benchLexResult lr;
+        benchLoadResult dr;
+        struct rusage ru;
+        if(!benchSpawn(BENCH_LEX,NULL,corpus[c],rows,cols,mb,&lr,sizeof(lr),&ru) ||
+            !benchSpawn(BENCH_LOAD,NULL,corpus[c],rows,cols,mb,&dr,sizeof(dr),&ru)){
+            printf("%-14s failed\n",names[c]);
+            worse=1;
+            continue;
+        }
+        char* what[5]={"hl","scan","split","stream","getline"};
+        double mbs[5]={lr.hl_mbs,lr.scan_mbs,dr.split_mbs,dr.stream_mbs,dr.getline_mbs};
+        char notes[80]="",note[16];
+        printf("%-14s %8.1f",names[c],dr.bytes/(double)BENCH_MB);
+        for(int k=0;k<5;k++){
+            if(k<2) printf(" %10.1f",mbs[k]);
+            else printf(" %*.2f",k<4 ? 11 : 12,mbs[k]/1024);
+            worse|=benchCompareRate(rates,nrates,what[k],names[c],mbs[k],pct,note);
+            strcat(notes,note);
+            if(fout) fprintf(fout,"rate\t%s\t%s\t%.1f\n",what[k],names[c],mbs[k]);
+        }
+        printf("%s%s\n",notes[0] ? "  worse:" : "",notes);
+    }
+    if(fout) fclose(fout);
+    free(base);
+    free(rates);
+    return worse;
+}
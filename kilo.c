@@ -10,17 +10,47 @@
 #include<stdarg.h>
 #include<ctype.h>
 #include<errno.h>
+#include<limits.h>
+#include<poll.h>
+#include<pthread.h>
 #include<fcntl.h>
 #include<sys/ioctl.h>
+#include<sys/mman.h>
+#include<sys/resource.h>
+#include<sys/stat.h>
+#include<sys/uio.h>
 #include<sys/types.h>
 #include<time.h>
 #include<string.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include<immintrin.h>
+#endif
 
 /* ***define*** */
 #define CTRL_KEY(k) ((k)&0x1f)  //make it more readable,compared to use ascii representation directly
 #define KILO_VERSION "0.0.1"    // use the KILO prefix, lest it collides with something defined in the libiaries
 #define KILO_TAB_STOP 8
 #define KILO_QUIT_TIMES 3
+#define KILO_ESC_WAIT 100   /* ms to wait for the rest of an escape sequence */
+#ifndef KILO_IDLE
+#define KILO_IDLE()         /* a headless driver (bench/bench.c) defines this to hand in the next key */
+#endif
+#define KILO_GAP_MIN 16     /* spare bytes opened up in a row the first time it is typed into */
+#define KILO_HL_CHECKPOINT 64   /* rows between two saved multiline comment states */
+#define KILO_HL_PARALLEL_ROWS 65536   /* unscanned rows worth handing to worker threads */
+#define KILO_THREADS 8     /* at most this many worker threads for one job */
+#define KILO_SEARCH_MAX 4194304 /* matches kept for one query, more are only counted */
+#define KILO_SEARCH_PARALLEL_ROWS 65536 /* buffers this long are searched on worker threads */
+#define KILO_UNDO_MB 64    /* default cap on the undo journal, KILO_UNDO_MB in the environment overrides it */
+#define KILO_SAVE_IOV 1024   /* iovecs handed to one writev() when saving */
+#define KILO_LOAD_FIRST (64*1024) /* bytes of a file read before the first paint, the rest loads behind it */
+#define KILO_LOAD_BATCH 256  /* leaves the loader hands over at once */
+#define KILO_READ_BLOCK (1<<20) /* bytes read at once from a file that can't be mapped */
+#define KILO_PAGE_READ (1<<20) /* bytes read at once when indexing a paged file, or copying it out */
+#define KILO_PROF_FRAMES 32 /* frames the profiler overlay averages over */
+#define KILO_TRACE_MAX 4194304 /* events kept for KILO_TRACE, later ones are dropped */
+#define ROPE_LEAF_ROWS 64   /* rows stored together in one leaf of the row tree */
+#define ROPE_FANOUT 32      /* children of an inner node of the row tree */
 
 enum editorKey{
     BACKSPACE=127,
@@ -32,7 +62,8 @@ enum editorKey{
     HOME_KEY,
     END_KEY,
     PAGE_UP,
-    PAGE_DOWN
+    PAGE_DOWN,
+    PASTE_TEXT/* a bracketed paste, the text is in E.paste */
 };
 enum editorHighlight{
     HL_NORMAL=0,
@@ -48,7 +79,34 @@ enum editorHighlight{
 #define HL_HIGHLIGHT_NUMBERS (1<<0)
 #define HL_HIGHLIGHT_STRINGS (1<<1)
 
+#define LEX_SEP (1<<0)      /* ends a word: white space, NUL and most punctuation */
+#define LEX_DIGIT (1<<1)
+#define LEX_KW (1<<2)       /* some keyword starts with it */
+#define LEX_TRIGGER (1<<3)  /* may open a comment or a string: first byte of a comment start, or a quote */
+
+#define ROW_BORROWED (1<<0)/* chars points into E.map, a page or a block read in (not ours to free or write), copy it out before the first edit */
+#define ROW_RENDER_VALID (1<<1)
+#define ROW_HL_VALID (1<<2)/* hl is right for the incoming state in ROW_IN_COMMENT */
+#define ROW_STATE_VALID (1<<3)/* hl_open_comment is right for the incoming state in ROW_IN_COMMENT */
+#define ROW_IN_COMMENT (1<<4)
+#define ROW_SHARED (1<<5)/* chars may be read by a save in progress, copy it out before the first edit */
+
 /* ***data*** */
+struct editorKeyword{
+    char* word;
+    int len;/* without the trailing | */
+    unsigned char hl;/* HL_KEYWORD1 or HL_KEYWORD2 */
+};
+struct editorKeywordTable{
+    int maxlen;
+    int start[257];/* the keywords starting with c are kw[start[c]] up to kw[start[c+1]], shortest first */
+    int* bylen;/* and those of length l are kw[bylen[c*(maxlen+2)+l]] up to kw[bylen[c*(maxlen+2)+l+1]] */
+    struct editorKeyword kw[];
+};
+struct editorLexer{
+    unsigned char cls[256];/* LEX_* bits of every byte */
+    int scs_len,mcs_len,mce_len;
+};
 struct editorSyntax{
     char* filetype;
     char** filematch;
@@ -59,16 +117,86 @@ struct editorSyntax{
     int flags;
     /* flags is a bit field that will contain flags for
     whether to highlight numbers and whether to highlight strings for that filetype */
+    struct editorKeywordTable* kwtab;/* keywords, compiled by editorSyntaxCompile at startup */
+    struct editorLexer* lex;/* byte classes, compiled along with kwtab */
 };
+typedef struct rowTab{
+    int cx;/* where the tab is in chars */
+    int rx;/* and the render column it starts at, it runs to the next tab stop */
+}rowTab;
 typedef struct erow{
-    int idx;
     int size;
     int rsize;
     char* chars;
     char* render;
     unsigned char* hl;/* highlight info */
     int hl_open_comment;
+    int flags;/* ROW_* bits. render and hl are built lazily, the first time the row is drawn or searched */
+    int gap;/* chars[gap..gap+gaplen) is unused, so typing at the cursor doesn't shift the rest of the line */
+    int gaplen;
+    rowTab* tabs;/* every tab of the row in order, kept along with render */
+    int ntabs;
 }erow;
+#define ROW_CHAR(row,j) ((j)<(row)->gap ? (row)->chars[(j)] : (row)->chars[(j)+(row)->gaplen])
+typedef struct ropeNode{
+    /* the rows live in a B+tree: leaves hold up to ROPE_LEAF_ROWS erows side by side,
+    inner nodes know how many rows sit below each child. so finding, inserting and deleting
+    row `at` is O(log n), and a row's index is found on the way down instead of being stored.
+    a loaded file is a run of pages, leaves that only know where their lines are in the file
+    until one of their rows is looked at, see editorPageNew(). so what a mapped file costs
+    grows with the rows touched, about one leaf node per ROPE_LEAF_ROWS lines otherwise */
+    int leaf;
+    int n;/* rows in a leaf, children in an inner node */
+    int count;/* rows in the whole subtree */
+    int ref;/* parents (or roots) pointing here. above 1 the node is shared with a save in progress */
+    erow* row;/* leaf only, NULL while a page is not read in */
+    struct ropeNode** child;/* inner node only, room for ROPE_FANOUT. kept apart so a leaf stays small */
+    long long off,len;/* a page: a leaf whose rows are still bytes off..off+len of the file. off is -1 otherwise */
+    char* page;/* those bytes while they are read in, the rows borrow their chars from them */
+    long long extra;/* render, hl and tabs of a page's rows, as last counted into E.page_bytes */
+    struct ropeNode *newer,*older;/* the pages read in, from E.page_newest to E.page_oldest */
+}ropeNode;
+typedef struct searchMatch{
+    int row;
+    int col;/* in chars */
+    int len;
+}searchMatch;
+#define UNDO_INSERT_TEXT 0
+#define UNDO_DELETE_TEXT 1
+#define UNDO_INSERT_ROW 2
+#define UNDO_DELETE_ROW 3
+#define UNDO_STEP (1<<0)/* first op of a step, undo and redo go a whole step at a time */
+#define UNDO_BACKWARD (1<<1)/* a run of backspaces, the text is stored last char first */
+typedef struct undoOp{
+    int type;/* UNDO_INSERT_* and UNDO_DELETE_* are the primitive edits */
+    int flags;
+    int row,col;
+    int len;
+    long long off;/* the text is E.undo_arena[off-E.undo_base] on */
+    int cx,cy;/* UNDO_STEP only: the cursor before the step */
+    int acx,acy;/* and after it */
+}undoOp;
+enum profZone{/* what the profiler times, PROF_NAME[] has their names in the trace */
+    PROF_FRAME=0,
+    PROF_READKEY,
+    PROF_KEY,
+    PROF_SYNTAX,
+    PROF_DRAW,
+    PROF_WRITE,
+    PROF_SAVE,
+    PROF_SAVE_THREAD
+};
+typedef struct profEvent{/* one timed stretch, kept for the KILO_TRACE file */
+    long long start;/* ns, CLOCK_MONOTONIC */
+    long long dur;
+    short zone;
+    short tid;/* trace track: 0 frames, 1 the main thread, 2 the save thread */
+}profEvent;
+typedef struct screenCell{
+    char c;
+    unsigned char attr;/* SGR foreground color, plus CELL_INVERSE */
+}screenCell;
+#define CELL_INVERSE (1<<7)
 struct editorConfig{
     int cx,cy;/* E.cy now refers to the position of the cursor within the text file */
     int rx;
@@ -77,12 +205,91 @@ struct editorConfig{
     int screenrows;
     int screencols;
     int numrows;
-    erow* row;
+    ropeNode* rows;/* root of the row tree, use editorRowAt() to get at a row */
+    int gaprow;/* the only row whose gap may be somewhere other than its end, -1 if none */
+    unsigned char* hlck;/* hlck[c] is 1 if row c*KILO_HL_CHECKPOINT starts inside a multiline comment */
+    int hlck_valid;/* how many leading checkpoints are up to date, always at least 1 (row 0 starts outside) */
+    int hlck_cap;
+    char* map;/* the file opened with mmap(), rows borrow their chars from it until they are edited */
+    size_t maplen;
     int dirty;/* We call a text buffer “dirty” if it has been modified since opening or saving the file. */
     char* filename;
     char statusmsg[80];
     time_t statusmsg_time;
     struct editorSyntax* syntax;
+    screenCell* frame;/* the screen being drawn, (screenrows+2)*screencols cells */
+    screenCell* shadow;/* what the terminal shows, from the last frame we sent */
+    int shadow_rowoff;/* E.rowoff of the shadow, a change means the text rows can be scrolled */
+    int frame_bytes;/* written by the last editorRefreshScreen() */
+    int show_frame_bytes;/* KILO_FRAME_BYTES is set: put frame_bytes in the status bar */
+    int frame_ms;/* from KILO_MAX_FPS: at least this long between two frames, 0 for no limit */
+    char inbuf[4096];/* input is read in bulk, keys are decoded from here */
+    int inlen,inpos;
+    searchMatch* matches;/* every place the query is found, in file order, while the search prompt is up */
+    int nmatches,matchcap;
+    int nfound;/* all the matches, also those past KILO_SEARCH_MAX */
+    int match;/* the one the cursor is on, -1 for none */
+    int matches_all;/* 0 if KILO_SEARCH_MAX cut the list short */
+    char* query;/* the query the matches are for */
+    int querylen;
+    int search_regex;/* Ctrl-R in the search prompt: the query is a regular expression */
+    int search_bad;/* and it doesn't parse */
+    char* paste;/* the text of the last PASTE_TEXT key */
+    int pastelen,pastecap;
+    undoOp* undo;/* the journal: undo[undo_head..undo_cur) can be undone, undo[undo_cur..undo_n) redone */
+    int undo_head,undo_cur,undo_n,undo_cap;
+    char* undo_arena;/* the text of every op back to back, dropped from the front as old steps go */
+    long long undo_base,undo_end;/* offsets of the first and one past the last byte in the arena */
+    long long undo_arenacap;
+    long long undo_limit;/* bytes the journal may take, ops and text */
+    int undo_step;/* index of the first op of the step still being recorded, -1 if none */
+    int undo_kind;/* what kind of key that step came from, runs of typing or erasing make one step */
+    int undo_cx,undo_cy;/* the cursor when the key came */
+    int undo_off;/* edits are not journaled: while undoing and redoing, and while loading a file */
+    int saving;/* a save is being written in the background */
+    pthread_t save_thread;
+    ropeNode* save_rows;/* the row tree as it was when the save began */
+    int save_pipe[2];/* the save thread writes a byte here when it is done */
+    char* save_path;/* the file being saved, and the temp file it is written to first */
+    char* save_tmp;
+    int save_fd;
+    long long save_len;/* bytes written, -1 on error with save_err */
+    int save_err;
+    long long save_start,save_ms;
+    long save_rss0,save_rss1;/* KB resident when the save began and when its thread was done */
+    int save_dirty;/* E.dirty when the save began, those edits are the ones it saves */
+    char** save_garbage;/* chars edits let go of while a save may still read them */
+    int save_ngarbage,save_garbagecap;
+    int loading;/* a thread is still splitting the rest of the mapping into rows */
+    pthread_t load_thread;
+    int load_pipe[2];/* the loader writes a byte here when it has leaves ready, or is done */
+    pthread_mutex_t load_mutex;/* guards the four fields below, the loader's side of the hand-over */
+    ropeNode** load_ready;/* full leaves not yet hung onto E.rows */
+    int load_nready,load_readycap;
+    long long load_pos;/* bytes of the file turned into rows, ready ones included */
+    int load_done;
+    long long load_bytes;/* bytes of the file the rows in E.rows cover */
+    long long load_size;/* bytes in the file being loaded */
+    int load_scan;/* the load is done, the comment state scan of its tail waits for the main loop */
+    int paging;/* the file is read in a page at a time instead of mapped, see editorPageIn() */
+    int page_fd;
+    long long page_limit;/* bytes the pages read in may take, with the rows made of them, from -m on the command line */
+    long long page_bytes;
+    ropeNode *page_newest,*page_oldest;
+    int page_hold;/* pages are not dropped while above 0 */
+    ropeNode* page_keep;/* nor is this one, the page of the row a comment state walk is for */
+    char** page_garbage;/* pages given up by edits, the edit may still be copying from them */
+    int page_ngarbage,page_garbagecap;
+    int profiling;/* the timers run: the overlay is up or KILO_TRACE is set */
+    int prof_overlay;/* Ctrl-P: last and average frame time in the status bar */
+    long long prof_busy;/* ns the first key the next frame shows came in, 0 if none has */
+    long long prof_frame[KILO_PROF_FRAMES];/* ns, the times of the last frames */
+    int prof_nframes;
+    char* trace_path;/* KILO_TRACE: every timed stretch goes there as Chrome trace JSON on exit */
+    profEvent* trace;
+    int ntrace,tracecap;
+    int trace_dropped;
+    long long save_t0,save_t1;/* ns, the save thread's run */
     struct termios orig_termios;
 };
 struct editorConfig E;
@@ -102,7 +309,9 @@ struct editorSyntax HLDB[]={    /* HLDB, highlight data base */
         C_HL_extensions,
         C_HL_keywords,
         "//","/*","*/",
-        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+        NULL,
+        NULL
     },
 };
 #define HLDB_ENTRIES (sizeof(HLDB)/sizeof(HLDB[0]))/* store the length of the HLDB array */
@@ -110,7 +319,22 @@ struct editorSyntax HLDB[]={    /* HLDB, highlight data base */
 /* ***prototypes*** */
 void editorSetStatusMessage(const char* fmt,...);
 void editorRefreshScreen();
+void editorUpdateSyntax(int filerow);
+int editorSyntaxStateAt(int filerow);
+void editorSyntaxChanged(int filerow);
 char* editorPrompt(char* prompt,void (*callback)(char*,int));
+void editorUndoRecord(int type,int row,int col,char* s,int len);
+void editorSaveDone();
+ropeNode* editorPageNew(long long off);
+void editorPageIn(ropeNode* leaf);
+void editorPageUse(ropeNode* leaf);
+void editorPageOwn(ropeNode* leaf);
+void editorPageForget(ropeNode* leaf);
+void editorPageTrim();
+void editorLoadPoll();
+void editorLoadFinish();
+long long editorProfNow();
+void editorProfEnd(int zone,long long start);
 
 /* ***terminal*** */
 void die(const char* s){
@@ -121,6 +345,7 @@ void die(const char* s){
     exit(1);
 }
 void disableRawMode(){
+    write(STDOUT_FILENO,"\x1b[?2004l",8);
     if(tcsetattr(STDIN_FILENO,TCSAFLUSH,&E.orig_termios)==-1)
         die("tcsetattr");
 }
@@ -154,7 +379,7 @@ void enableRawMode(){
     */
 
     raw.c_cc[VMIN]=0;
-    raw.c_cc[VTIME]=1;
+    raw.c_cc[VTIME]=0;/* poll() does the waiting now, read() only takes what is already there */
     /*VMIN and VTIME come from <termios.h>. They are indexes into the c_cc field, which stands for “control characters”, 
     an array of bytes that control various terminal settings.
 
@@ -162,32 +387,133 @@ void enableRawMode(){
     We set it to 0 so that read() returns as soon as there is any input to be read. 
 
     The VTIME value sets the maximum amount of time to wait before read() returns.
-    It is in tenths of a second, so we set it to 1/10 of a second, or 100 milliseconds. 
-    If read() times out, it will return 0, 
+    It is 0: read() never blocks, it returns what is queued or 0 right away. all the waiting
+    is done by poll() in editorInputWait(), which only reads once input is there.
     */
 
     if(tcsetattr(STDIN_FILENO,TCSAFLUSH,&raw)==-1) die("tcsetattr");
+    write(STDOUT_FILENO,"\x1b[?2004h",8);
+    /* bracketed paste mode: the terminal wraps pasted text in \x1b[200~ and \x1b[201~,
+    so a paste can be told apart from typing and inserted in one go */
     /*TCSAFLUSH argument specifies when to apply the change: 
     in this case, it waits for all pending output to be written to the terminal,
     and also discards any input that hasn’t been read.
     */
 }
-int editorReadKey(){
-    int nread;
-    char c;
-    while((nread=read(STDIN_FILENO,&c,1))!=1){
-        if(nread==-1 && errno!=EAGAIN) die("read");
-        /* In Cygwin, when read() times out it returns -1 with an errno of EAGAIN, 
-        instead of just returning 0 like it’s supposed to.*/
+long long editorMsNow(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec*1000LL+ts.tv_nsec/1000000;
+}
+long editorRssKb(){/* resident set size right now, in KB, -1 if /proc can't tell */
+    long pages=-1;
+    FILE* fp=fopen("/proc/self/statm","r");
+    if(!fp) return -1;
+    if(fscanf(fp,"%*d %ld",&pages)!=1) pages=-1;
+    fclose(fp);
+    return pages<0 ? -1 : pages*(sysconf(_SC_PAGESIZE)/1024);
+}
+long long editorNsNow(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec*1000000000LL+ts.tv_nsec;
+}
+
+int editorInputPending(){/* is a key waiting? never blocks, and reads nothing in */
+    if(E.inpos<E.inlen) return 1;
+    struct pollfd pfd={STDIN_FILENO,POLLIN,0};
+    return poll(&pfd,1,0)>0;
+}
+int editorInputWait(int timeout){
+    /* 1 if input is ready within timeout ms (-1 waits as long as it takes). everything the
+    terminal has queued is read in one go, so a burst of keys costs one system call */
+    if(E.inpos<E.inlen) return 1;
+    if(timeout==-1){
+        KILO_IDLE();/* every key so far is handled and drawn */
+        if(E.inpos<E.inlen) return 1;
+    }
+    struct pollfd pfd[3]={{STDIN_FILENO,POLLIN,0},{E.save_pipe[0],POLLIN,0},{E.load_pipe[0],POLLIN,0}};
+    long long deadline=timeout>0 ? editorMsNow()+timeout : 0;
+    int left=timeout;
+    while(1){
+        pfd[1].fd=E.saving ? E.save_pipe[0] : -1;/* poll() skips negative descriptors */
+        pfd[2].fd=E.loading ? E.load_pipe[0] : -1;
+        int r=poll(pfd,3,left);
+        if(r==-1 && errno!=EINTR) die("poll");
+        if(r<=0) return 0;
+        if(!(pfd[1].revents & POLLIN) && !(pfd[2].revents & POLLIN)) break;
+        if(pfd[1].revents & POLLIN) editorSaveDone();/* a background save just finished */
+        if(pfd[2].revents & POLLIN) editorLoadPoll();/* more of the file is in */
+        if(timeout==-1) editorRefreshScreen();/* nothing else would show it before the next key */
+        if(pfd[0].revents & POLLIN) break;
+        if(timeout>0){/* a wake from a pipe doesn't restart the wait, only the rest of it is left */
+            left=deadline-editorMsNow();
+            if(left<0) left=0;
+        }
+    }
+    int nread=read(STDIN_FILENO,E.inbuf,sizeof(E.inbuf));
+    if(nread==-1 && errno!=EAGAIN) die("read");
+    /* In Cygwin, when read() times out it returns -1 with an errno of EAGAIN, 
+    instead of just returning 0 like it’s supposed to.*/
+    if(nread<=0) return 0;
+    E.inpos=0;
+    E.inlen=nread;
+    return 1;
+}
+int editorReadByte(char* c,int timeout){
+    if(!editorInputWait(timeout)) return 0;
+    *c=E.inbuf[E.inpos++];
+    return 1;
+}
+void editorPasteAppend(const char* s,int len){
+    if(E.pastelen+len>E.pastecap){
+        while(E.pastelen+len>E.pastecap) E.pastecap=E.pastecap ? E.pastecap*2 : 4096;
+        E.paste=realloc(E.paste,E.pastecap);
+    }
+    memcpy(&E.paste[E.pastelen],s,len);
+    E.pastelen+=len;
+}
+void editorReadPaste(){
+    /* everything up to \x1b[201~ is text. it is copied out of the input buffer a chunk at a
+    time, only an escape byte has to be looked at more closely */
+    E.pastelen=0;
+    while(1){
+        if(!editorInputWait(-1)) continue;
+        char* p=&E.inbuf[E.inpos];
+        char* esc=memchr(p,'\x1b',E.inlen-E.inpos);
+        int n=esc ? esc-p : E.inlen-E.inpos;
+        editorPasteAppend(p,n);
+        E.inpos+=n;
+        if(!esc) continue;
+        E.inpos++;
+        char seq[5];
+        int k=0,got=0;
+        while(k<5 && (got=editorReadByte(&seq[k],KILO_ESC_WAIT)) && seq[k]=="[201~"[k]) k++;
+        if(k==5) return;
+        editorPasteAppend("\x1b",1);
+        editorPasteAppend(seq,k);
+        if(got) E.inpos--;/* the byte that broke the match goes round again, it may be the escape of the marker */
     }
+}
+int editorDecodeKey(char c){/* the key that starts with c, reading the rest of it */
     if(c=='\x1b'){
         char seq[3];
-        if(read(STDIN_FILENO,&seq[0],1)!=1) return '\x1b';
-        if(read(STDIN_FILENO,&seq[1],1)!=1) return '\x1b';
+        if(!editorReadByte(&seq[0],KILO_ESC_WAIT)) return '\x1b';
+        if(!editorReadByte(&seq[1],KILO_ESC_WAIT)) return '\x1b';
         
         if(seq[0]=='['){
             if(seq[1]>='0' && seq[1]<='9'){
-                if(read(STDIN_FILENO,&seq[2],1)!=1) return '\x1b';
+                if(!editorReadByte(&seq[2],KILO_ESC_WAIT)) return '\x1b';
+                if(seq[2]>='0' && seq[2]<='9'){/* longer numbers, only 200~ (paste start) is ours */
+                    int num=(seq[1]-'0')*10+seq[2]-'0';
+                    char d=0;
+                    while(editorReadByte(&d,KILO_ESC_WAIT) && d>='0' && d<='9') num=num*10+d-'0';
+                    if(d=='~' && num==200){
+                        editorReadPaste();
+                        return PASTE_TEXT;
+                    }
+                    return '\x1b';
+                }
                 if(seq[2]=='~'){
                     switch(seq[1]){
                         case '1': return HOME_KEY;
@@ -220,13 +546,22 @@ int editorReadKey(){
         return c;
     }
 }
+int editorReadKey(){
+    char c;
+    while(!editorReadByte(&c,-1));
+    long long t=editorProfNow();/* from here on it is work, not waiting */
+    if(t && !E.prof_busy) E.prof_busy=t;
+    int key=editorDecodeKey(c);
+    editorProfEnd(PROF_READKEY,t);
+    return key;
+}
 int getCursorPosition(int* rows,int* cols){
     char buf[32];
     unsigned int i=0;
     if(write(STDOUT_FILENO,"\x1b[6n",4)!=4) return -1;
 
     while(i<sizeof(buf)-1){
-        if(read(STDIN_FILENO,&buf[i],1)!=1) break;
+        if(!editorReadByte(&buf[i],1000)) break;
         if(buf[i]=='R') break;
         i++;
     }
@@ -258,128 +593,758 @@ int getWindowSize(int* rows, int* cols){
     }
 }
 
-/* **syntax highlighting** */
-int is_seperator(int c){
-    return isspace(c) || c=='\0' || strchr(",.()+-/*=~%<>[];",c)!=NULL;
+/* ***profile*** */
+/* a timed stretch is t=editorProfNow() before it and editorProfEnd(zone,t) after. with
+the profiler off t is 0 and both are a test and a branch, no clock is read */
+const char* PROF_NAME[]={"frame","editorReadKey","key","editorUpdateSyntax","editorDrawRows",
+    "write","editorSave","save thread"};
+long long editorProfNow(){
+    return E.profiling ? editorNsNow() : 0;
+}
+void editorProfEvent(int zone,long long start,long long dur,int tid){
+    if(!E.trace_path) return;
+    if(E.ntrace==E.tracecap){
+        if(E.tracecap>=KILO_TRACE_MAX){
+            E.trace_dropped++;
+            return;
+        }
+        E.tracecap=E.tracecap ? E.tracecap*2 : 4096;
+        E.trace=realloc(E.trace,E.tracecap*sizeof(profEvent));
+    }
+    profEvent* ev=&E.trace[E.ntrace++];
+    ev->start=start;
+    ev->dur=dur;
+    ev->zone=zone;
+    ev->tid=tid;
+}
+void editorProfEnd(int zone,long long start){
+    if(!start) return;
+    editorProfEvent(zone,start,editorNsNow()-start,1);
+}
+void editorProfFrame(long long start){
+    /* a frame went out. it took from the first key it shows coming in, or from the start
+    of the refresh if no key is behind it (the loader, a finished save) */
+    if(!start) return;
+    long long now=editorNsNow();
+    if(E.prof_busy && E.prof_busy<start) start=E.prof_busy;
+    E.prof_busy=0;
+    E.prof_frame[E.prof_nframes%KILO_PROF_FRAMES]=now-start;
+    E.prof_nframes++;
+    editorProfEvent(PROF_FRAME,start,now-start,0);
+}
+void editorTraceWrite(){
+    /* at exit: the events in the Chrome trace event format, for chrome://tracing or Perfetto.
+    ts and dur are in microseconds */
+    FILE* fp=fopen(E.trace_path,"w");
+    if(!fp) return;
+    const char* track[]={"frames","main","save"};
+    fprintf(fp,"{\"traceEvents\":[\n");
+    for(int j=0;j<3;j++){
+        fprintf(fp,"{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}},\n",
+            j,track[j]);
+    }
+    long long base=E.ntrace ? E.trace[0].start : 0;
+    for(int j=0;j<E.ntrace;j++){
+        profEvent* ev=&E.trace[j];
+        fprintf(fp,"{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d},\n",
+            PROF_NAME[ev->zone],(ev->start-base)/1000.0,ev->dur/1000.0,ev->tid);
+    }
+    fprintf(fp,"{\"name\":\"dropped\",\"ph\":\"M\",\"pid\":1,\"args\":{\"events\":%d}}\n",E.trace_dropped);
+    fprintf(fp,"],\"displayTimeUnit\":\"ms\"}\n");
+    fclose(fp);
 }
-void editorUpdateSyntax(erow* row){
-    row->hl=realloc(row->hl,row->rsize);
-    memset(row->hl,HL_NORMAL,row->rsize);
 
-    if(E.syntax==NULL) return;
+/* ***row tree*** */
+ropeNode* ropeNewNode(int leaf){
+    ropeNode* node=calloc(1,sizeof(ropeNode));
+    node->leaf=leaf;
+    node->ref=1;
+    node->off=-1;
+    if(leaf) node->row=malloc(sizeof(erow)*ROPE_LEAF_ROWS);
+    else node->child=malloc(sizeof(ropeNode*)*ROPE_FANOUT);
+    return node;
+}
+void ropeFreeNode(ropeNode* node){
+    if(node->page) editorPageForget(node);
+    free(node->row);
+    free(node->child);
+    free(node);
+}
+/* a save takes the tree as it is by holding a reference to the root, which costs nothing.
+from then on the tree is copy-on-write: a node that is shared (ref above 1) is copied before
+it is changed, along with the path down to it, and the save goes on reading the old one. the
+rows of a copied leaf are marked ROW_SHARED, their chars are copied in turn when edited.
+render, hl and the flags are never read by a save, they may still be updated in place */
+ropeNode* ropeOwn(ropeNode** slot){/* *slot, copied first if it is shared */
+    ropeNode* node=*slot;
+    if(node->ref==1){
+        if(node->off>=0) editorPageOwn(node);
+        return node;
+    }
+    ropeNode* copy=ropeNewNode(node->leaf);
+    copy->n=node->n;
+    copy->count=node->count;
+    int j;
+    if(node->leaf){
+        if(node->off>=0) editorPageUse(node);
+        memcpy(copy->row,node->row,sizeof(erow)*node->n);
+        for(j=0;j<node->n;j++){
+            if(!(copy->row[j].flags & ROW_BORROWED)) copy->row[j].flags|=ROW_SHARED;
+        }
+    }else{
+        memcpy(copy->child,node->child,sizeof(ropeNode*)*node->n);
+        for(j=0;j<node->n;j++) node->child[j]->ref++;
+    }
+    node->ref--;
+    *slot=copy;
+    if(node->page){/* the copy takes over the rows, the save only needs to know where the page is */
+        editorPageOwn(copy);
+        editorPageForget(node);
+    }
+    return copy;
+}
+void ropeRelease(ropeNode* node){/* drop a reference, the node goes with the last one */
+    if(--node->ref>0) return;
+    int j;
+    if(!node->leaf){
+        for(j=0;j<node->n;j++) ropeRelease(node->child[j]);
+    }
+    ropeFreeNode(node);
+}
+int ropeChildFor(ropeNode* node,int* at){
+    /* pick the child that holds row *at and make *at relative to it.
+    an index equal to the row count falls into the last child, that's how we append */
+    int i=0;
+    while(i<node->n-1 && *at>=node->child[i]->count){
+        *at-=node->child[i]->count;
+        i++;
+    }
+    return i;
+}
+ropeNode* ropeInsertAt(ropeNode* node,int at,erow** slot){
+    /* returns the new right sibling when node had to be split, NULL otherwise */
+    ropeNode* right=NULL;
+    if(node->leaf){
+        ropeNode* target=node;
+        if(node->n==ROPE_LEAF_ROWS){
+            /* appending to a full leaf starts a fresh one instead of halving it,
+            so loading a file sequentially leaves every leaf full */
+            int half=(at==node->n) ? node->n : node->n/2;
+            right=ropeNewNode(1);
+            right->n=node->n-half;
+            memcpy(right->row,&node->row[half],sizeof(erow)*right->n);
+            node->n=half;
+            if(at>half || half==ROPE_LEAF_ROWS){
+                target=right;
+                at-=half;
+            }
+        }
+        memmove(&target->row[at+1],&target->row[at],sizeof(erow)*(target->n-at));
+        target->n++;
+        *slot=&target->row[at];
+        node->count=node->n;
+        if(right) right->count=right->n;
+        return right;
+    }
 
-    char** keywords=E.syntax->keywords;/* easier typing */
+    int i=ropeChildFor(node,&at);
+    ropeNode* split=ropeInsertAt(ropeOwn(&node->child[i]),at,slot);
+    node->count++;
+    if(split==NULL) return NULL;
+
+    ropeNode* child[ROPE_FANOUT+1];
+    memcpy(child,node->child,sizeof(ropeNode*)*(i+1));
+    child[i+1]=split;
+    memcpy(&child[i+2],&node->child[i+1],sizeof(ropeNode*)*(node->n-i-1));
+    int n=node->n+1;
+    int half=n;
+    if(n>ROPE_FANOUT){
+        half=(i+2==n) ? ROPE_FANOUT : n/2;
+        right=ropeNewNode(0);
+        right->n=n-half;
+        memcpy(right->child,&child[half],sizeof(ropeNode*)*right->n);
+        right->count=0;
+        for(int j=0;j<right->n;j++) right->count+=right->child[j]->count;
+        node->count-=right->count;
+    }
+    node->n=half;
+    memcpy(node->child,child,sizeof(ropeNode*)*half);
+    return right;
+}
+erow* ropeInsert(int at){/* make room for a row at index at, the caller fills it in */
+    erow* slot;
+    ropeNode* split=ropeInsertAt(ropeOwn(&E.rows),at,&slot);
+    if(split){
+        ropeNode* root=ropeNewNode(0);
+        root->n=2;
+        root->child[0]=E.rows;
+        root->child[1]=split;
+        root->count=E.rows->count+split->count;
+        E.rows=root;
+    }
+    return slot;
+}
+ropeNode* ropeAppendAt(ropeNode* node,ropeNode* leaf){
+    /* hang a full leaf after the last one under node. all leaves are at the same depth,
+    so it goes to the bottom inner node on the right edge. returns the new right sibling
+    when node had to be split, NULL otherwise */
+    node->count+=leaf->count;
+    ropeNode* add=leaf;
+    if(!node->child[node->n-1]->leaf){
+        add=ropeAppendAt(ropeOwn(&node->child[node->n-1]),leaf);
+        if(add==NULL) return NULL;
+    }
+    if(node->n<ROPE_FANOUT){
+        node->child[node->n++]=add;
+        return NULL;
+    }
+    ropeNode* right=ropeNewNode(0);/* nothing will go to the left of it again, leave node full */
+    right->n=1;
+    right->child[0]=add;
+    right->count=add->count;
+    node->count-=add->count;
+    return right;
+}
+void ropeAppend(ropeNode* leaf){/* add a leaf of rows after the last row */
+    if(E.rows->leaf && E.rows->n==0){
+        ropeRelease(E.rows);
+        E.rows=leaf;
+        return;
+    }
+    ropeNode* split=leaf;
+    if(!E.rows->leaf) split=ropeAppendAt(ropeOwn(&E.rows),leaf);
+    if(split){
+        ropeNode* root=ropeNewNode(0);
+        root->n=2;
+        root->child[0]=E.rows;
+        root->child[1]=split;
+        root->count=E.rows->count+split->count;
+        E.rows=root;
+    }
+}
+void ropeMerge(ropeNode* node,int i){
+    /* fold child i+1 into child i when they fit in one node, so deleting
+    lots of rows doesn't leave a tree of nearly empty leaves behind */
+    ropeNode* a=node->child[i];
+    ropeNode* b=node->child[i+1];
+    int max=a->leaf ? ROPE_LEAF_ROWS : ROPE_FANOUT;
+    if(a->n+b->n>max) return;
+    a=ropeOwn(&node->child[i]);
+    int j;
+    if(a->leaf){
+        if(b->off>=0) editorPageUse(b);
+        memcpy(&a->row[a->n],b->row,sizeof(erow)*b->n);
+        for(j=a->n;b->ref>1 && j<a->n+b->n;j++){/* b stays with the save, these rows are in both */
+            if(!(a->row[j].flags & ROW_BORROWED)) a->row[j].flags|=ROW_SHARED;
+        }
+    }else{
+        memcpy(&a->child[a->n],b->child,sizeof(ropeNode*)*b->n);
+        for(j=0;b->ref>1 && j<b->n;j++) b->child[j]->ref++;
+    }
+    a->n+=b->n;
+    a->count+=b->count;
+    if(b->page) editorPageOwn(a);/* before b's page goes */
+    if(b->ref>1){
+        b->ref--;
+        if(b->page) editorPageForget(b);
+    }else{
+        ropeFreeNode(b);
+    }
+    memmove(&node->child[i+1],&node->child[i+2],sizeof(ropeNode*)*(node->n-i-2));
+    node->n--;
+}
+void ropeDeleteAt(ropeNode* node,int at){
+    node->count--;
+    if(node->leaf){
+        memmove(&node->row[at],&node->row[at+1],sizeof(erow)*(node->n-at-1));
+        node->n--;
+        return;
+    }
+    int i=ropeChildFor(node,&at);
+    ropeNode* child=ropeOwn(&node->child[i]);
+    ropeDeleteAt(child,at);
+    if(child->n==0){
+        ropeFreeNode(child);
+        memmove(&node->child[i],&node->child[i+1],sizeof(ropeNode*)*(node->n-i-1));
+        node->n--;
+    }else if(child->n<(child->leaf ? ROPE_LEAF_ROWS : ROPE_FANOUT)/4){
+        if(i+1<node->n) ropeMerge(node,i);
+        else if(i>0) ropeMerge(node,i-1);
+    }
+}
+void ropeDelete(int at){/* drop the slot of row at, the caller has freed what it pointed to */
+    ropeDeleteAt(ropeOwn(&E.rows),at);
+    while(!E.rows->leaf && E.rows->n<=1){
+        ropeNode* root=E.rows;
+        E.rows=root->n ? root->child[0] : ropeNewNode(1);
+        ropeFreeNode(root);
+    }
+}
+erow* editorRowAt(int at){
+    /* the pointer is good until the next row is inserted or deleted */
+    ropeNode* node=E.rows;
+    while(!node->leaf) node=node->child[ropeChildFor(node,&at)];
+    if(node->off>=0) editorPageUse(node);
+    return &node->row[at];
+}
+erow* ropeRowOwn(int at){/* editorRowAt() for a row whose chars are about to change */
+    ropeNode** slot=&E.rows;
+    while(1){
+        ropeNode* node=ropeOwn(slot);
+        if(node->leaf) return &node->row[at];
+        slot=&node->child[ropeChildFor(node,&at)];
+    }
+}
+ropeNode* editorRowLeaf(int at){/* the leaf row at is in, NULL past the last row. not read in if it is a page */
+    if(at>=E.numrows) return NULL;
+    ropeNode* node=E.rows;
+    while(!node->leaf) node=node->child[ropeChildFor(node,&at)];
+    return node;
+}
+int editorRowSpan(int at,erow** rows){
+    /* rows at, at+1... that sit next to each other in one leaf. for walking over many rows:
+    for(at=0;at<E.numrows;at+=n){ n=editorRowSpan(at,&rows); ... } */
+    ropeNode* node=E.rows;
+    while(!node->leaf) node=node->child[ropeChildFor(node,&at)];
+    if(node->off>=0) editorPageUse(node);
+    *rows=&node->row[at];
+    return node->n-at;
+}
 
-    char* scs=E.syntax->singleline_comment_start;/* easier typing */
-    char* mcs=E.syntax->multiline_comment_start;
-    char* mce=E.syntax->multiline_comment_end;
+void editorRowMoveGap(erow* row,int at){
+    if(at<row->gap){
+        memmove(&row->chars[at+row->gaplen],&row->chars[at],row->gap-at);
+    }else if(at>row->gap){
+        memmove(&row->chars[row->gap],&row->chars[row->gap+row->gaplen],at-row->gap);
+    }
+    row->gap=at;
+}
 
-    int scs_len=scs ? strlen(scs) : 0; 
-    int mcs_len=mcs ? strlen(mcs) : 0;
-    int mce_len=mce ? strlen(mce) : 0;
+char* editorRowChars(erow* row){
+    /* the contiguous view of a row, for the few readers (save, split, join) that need one */
+    if(row->gap!=row->size){
+        editorRowMoveGap(row,row->size);
+        E.gaprow=-1;/* only E.gaprow can have its gap away from the end */
+    }
+    if(!(row->flags & ROW_BORROWED)) row->chars[row->size]='\0';
+    return row->chars;
+}
+
+void editorCloseGap(){
+    if(E.gaprow==-1) return;
+    editorRowChars(editorRowAt(E.gaprow));
+    E.gaprow=-1;
+}
+
+/* **syntax highlighting** */
+int editorKeywordCmp(const void* a,const void* b){
+    const struct editorKeyword* x=a;
+    const struct editorKeyword* y=b;
+    if(x->word[0]!=y->word[0]) return (unsigned char)x->word[0]-(unsigned char)y->word[0];
+    return x->len-y->len;
+}
+void editorSyntaxCompile(struct editorSyntax* s){
+    /* bucket the keywords by first char and length, so a lookup only compares against the
+    keywords that start like the word at hand and are exactly as long */
+    int n=0;
+    while(s->keywords[n]) n++;
+    struct editorKeywordTable* t=malloc(sizeof(*t)+n*sizeof(struct editorKeyword));
+    t->maxlen=0;
+    int j;
+    for(j=0;j<n;j++){
+        struct editorKeyword* kw=&t->kw[j];
+        kw->word=s->keywords[j];
+        kw->len=strlen(kw->word);
+        kw->hl=HL_KEYWORD1;
+        if(kw->word[kw->len-1]=='|'){
+            kw->len--;
+            kw->hl=HL_KEYWORD2;
+        }
+        if(kw->len>t->maxlen) t->maxlen=kw->len;
+    }
+    qsort(t->kw,n,sizeof(struct editorKeyword),editorKeywordCmp);
+    int c=0;
+    for(j=0;j<n;j++){
+        while(c<=(unsigned char)t->kw[j].word[0]) t->start[c++]=j;
+    }
+    while(c<=256) t->start[c++]=n;
+    int w=t->maxlen+2;
+    t->bylen=malloc(256*w*sizeof(int));
+    for(c=0;c<256;c++){
+        int l;
+        j=t->start[c];
+        for(l=0;l<w;l++){
+            while(j<t->start[c+1] && t->kw[j].len<l) j++;
+            t->bylen[c*w+l]=j;
+        }
+    }
+    s->kwtab=t;
+
+    /* the lexer looks a byte up once instead of calling isspace, strchr and isdigit on it,
+    and only stops to compare comment markers and quotes at a byte that can start one */
+    struct editorLexer* lex=malloc(sizeof(*lex));
+    lex->scs_len=s->singleline_comment_start ? strlen(s->singleline_comment_start) : 0;
+    lex->mcs_len=s->multiline_comment_start ? strlen(s->multiline_comment_start) : 0;
+    lex->mce_len=s->multiline_comment_end ? strlen(s->multiline_comment_end) : 0;
+    for(c=0;c<256;c++){
+        unsigned char k=0;
+        if(isspace(c) || c==0 || strchr(",.()+-/*=~%<>[];",c)) k|=LEX_SEP;
+        if(isdigit(c)) k|=LEX_DIGIT;
+        if(t->start[c]<t->start[c+1]) k|=LEX_KW;
+        if((s->flags & HL_HIGHLIGHT_STRINGS) && (c=='"' || c=='\'')) k|=LEX_TRIGGER;
+        lex->cls[c]=k;
+    }
+    if(lex->scs_len) lex->cls[(unsigned char)s->singleline_comment_start[0]]|=LEX_TRIGGER;
+    if(lex->mcs_len) lex->cls[(unsigned char)s->multiline_comment_start[0]]|=LEX_TRIGGER;
+    s->lex=lex;
+}
+int editorSyntaxKeyword(char* word,int len){
+    /* HL_KEYWORD1 or HL_KEYWORD2 if word is a keyword, else HL_NORMAL */
+    struct editorKeywordTable* t=E.syntax->kwtab;
+    unsigned char c=word[0];
+    if(len>t->maxlen) return HL_NORMAL;
+    int* at=&t->bylen[c*(t->maxlen+2)+len];
+    int j;
+    for(j=at[0];j<at[1];j++){
+        if(!memcmp(t->kw[j].word+1,word+1,len-1)) return t->kw[j].hl;
+    }
+    return HL_NORMAL;
+}
+void editorSyntaxChanged(int filerow){
+    /* the end state of filerow may be different now, so are the checkpoints after it */
+    int c=filerow/KILO_HL_CHECKPOINT+1;
+    if(c<E.hlck_valid) E.hlck_valid=c;
+}
+int editorSyntaxScan(char* s,int len,int in_comment){
+    /* only the multiline comment state at the end of the line, without building render or hl.
+    tabs don't matter for it, so this runs on chars */
+    struct editorSyntax* syn=E.syntax;
+    char* scs=syn->singleline_comment_start;
+    char* mcs=syn->multiline_comment_start;
+    char* mce=syn->multiline_comment_end;
+    const unsigned char* cls=syn->lex->cls;
+    int scs_len=syn->lex->scs_len;
+    int mcs_len=syn->lex->mcs_len;
+    int mce_len=syn->lex->mce_len;
+    if(!mcs_len || !mce_len) return 0;
+
+    int in_string=0;
+    int i=0;
+    while(i<len){
+        if(in_comment){/* only the end marker matters, jump to its first byte */
+            char* p=memchr(&s[i],mce[0],len-i);
+            if(!p) return 1;
+            i=p-s;
+            if(i+mce_len<=len && !memcmp(&s[i],mce,mce_len)){
+                in_comment=0;
+                i+=mce_len;
+            }else{
+                i++;
+            }
+            continue;
+        }
+        if(in_string){
+            if(s[i]=='\\'){
+                i+=2;
+                continue;
+            }
+            if(s[i]==in_string) in_string=0;
+            i++;
+            continue;
+        }
+        while(i<len && !(cls[(unsigned char)s[i]] & LEX_TRIGGER)) i++;
+        if(i==len) break;
+        if(scs_len && i+scs_len<=len && !memcmp(&s[i],scs,scs_len)) return 0;
+        if(i+mcs_len<=len && !memcmp(&s[i],mcs,mcs_len)){
+            in_comment=1;
+            i+=mcs_len;
+            continue;
+        }
+        if((syn->flags & HL_HIGHLIGHT_STRINGS) && (s[i]=='"' || s[i]=='\'')) in_string=s[i];
+        i++;
+    }
+    return in_comment;
+}
+int editorThreads(){/* how many threads to split a job over */
+    if(E.paging) return 1;/* reading a page in changes the tree, only the main thread may */
+    int n=sysconf(_SC_NPROCESSORS_ONLN);
+    if(n>KILO_THREADS) n=KILO_THREADS;
+    return n<1 ? 1 : n;
+}
+typedef struct hlChunk{
+    int from,to;/* rows, both on a checkpoint */
+    int in,out;/* comment state at from, and at to */
+    int fixup;
+    pthread_t thread;
+}hlChunk;
+
+void* editorSyntaxWalk(void* arg){
+    /* scan the comment state of rows from..to, filling in the checkpoints on the way. a worker
+    gets a guessed `in`; with fixup set the guess was wrong and we stop as soon as a row's cached
+    in-state agrees with the real one, from there on the first pass was right */
+    hlChunk* ck=arg;
+    int state=ck->in;
+    int j=ck->from;
+    while(j<ck->to){
+        erow* rows;
+        int n=editorRowSpan(j,&rows);
+        if(n>ck->to-j) n=ck->to-j;
+        int k;
+        for(k=0;k<n;k++,j++){
+            erow* row=&rows[k];
+            if((row->flags & ROW_STATE_VALID) && !!(row->flags & ROW_IN_COMMENT)==state){
+                if(ck->fixup) return NULL;
+            }else{
+                row->flags&=~(ROW_HL_VALID|ROW_IN_COMMENT);
+                row->flags|=ROW_STATE_VALID|(state ? ROW_IN_COMMENT : 0);
+                row->hl_open_comment=editorSyntaxScan(editorRowChars(row),row->size,state);
+            }
+            state=row->hl_open_comment;
+            if((j+1)%KILO_HL_CHECKPOINT==0) E.hlck[(j+1)/KILO_HL_CHECKPOINT]=state;
+        }
+    }
+    ck->out=state;
+    return NULL;
+}
+void editorSyntaxParallel(int filerow){
+    /* a jump far past the checkpoints: split the rows in between over some threads, each
+    guessing it starts outside a comment. then go through the chunks in order, and redo
+    the start of those that guessed wrong, up to where they agree again */
+    int from=(E.hlck_valid-1)*KILO_HL_CHECKPOINT;
+    int to=filerow/KILO_HL_CHECKPOINT*KILO_HL_CHECKPOINT;
+    if(E.syntax==NULL || to-from<KILO_HL_PARALLEL_ROWS) return;
+    int nthreads=editorThreads();
+    if(nthreads<2) return;
+
+    int need=to/KILO_HL_CHECKPOINT+1;
+    if(need>E.hlck_cap){
+        while(E.hlck_cap<need) E.hlck_cap*=2;
+        E.hlck=realloc(E.hlck,E.hlck_cap);
+    }
+    editorCloseGap();/* the workers only read, so every row needs its text in one piece already */
+
+    hlChunk ck[KILO_THREADS];
+    int threaded[KILO_THREADS];
+    int per=(to-from)/nthreads/KILO_HL_CHECKPOINT*KILO_HL_CHECKPOINT;
+    int i;
+    for(i=0;i<nthreads;i++){
+        ck[i].from=from+i*per;
+        ck[i].to=(i==nthreads-1) ? to : ck[i].from+per;
+        ck[i].in=(i==0) ? E.hlck[E.hlck_valid-1] : 0;
+        ck[i].out=ck[i].in;
+        ck[i].fixup=0;
+        threaded[i]=(pthread_create(&ck[i].thread,NULL,editorSyntaxWalk,&ck[i])==0);
+        if(!threaded[i]) editorSyntaxWalk(&ck[i]);
+    }
+    int state=0;
+    for(i=0;i<nthreads;i++){
+        if(threaded[i]) pthread_join(ck[i].thread,NULL);
+        if(i>0 && state!=ck[i].in){
+            ck[i].in=state;
+            ck[i].fixup=1;
+            editorSyntaxWalk(&ck[i]);
+        }
+        state=ck[i].out;
+    }
+    E.hlck_valid=need;
+}
+int editorSyntaxStateAt(int filerow){
+    /* is filerow's start inside a multiline comment? walk from the closest checkpoint above
+    it, at most KILO_HL_CHECKPOINT rows once the checkpoints are in place. every row caches
+    its end state for the incoming state it was last seen with, so the walk is usually a
+    flag test per row and only rows nobody looked at yet get scanned */
+    if(E.syntax==NULL) return 0;
+    editorSyntaxParallel(filerow);
+    ropeNode* keep=E.page_keep;/* the caller goes on to build and draw filerow from its page */
+    E.page_keep=editorRowLeaf(filerow);
+    int c=filerow/KILO_HL_CHECKPOINT;
+    if(c>=E.hlck_valid) c=E.hlck_valid-1;
+    int state=E.hlck[c];
+    int j;
+    for(j=c*KILO_HL_CHECKPOINT;j<filerow;j++){
+        editorPageTrim();/* a long walk reads in a lot of pages */
+        erow* row=editorRowAt(j);
+        if(!(row->flags & ROW_STATE_VALID) || !!(row->flags & ROW_IN_COMMENT)!=state){
+            row->flags&=~(ROW_HL_VALID|ROW_STATE_VALID|ROW_IN_COMMENT);
+            row->flags|=ROW_STATE_VALID|(state ? ROW_IN_COMMENT : 0);
+            row->hl_open_comment=editorSyntaxScan(editorRowChars(row),row->size,state);
+        }
+        state=row->hl_open_comment;
+        if((j+1)%KILO_HL_CHECKPOINT==0 && (j+1)/KILO_HL_CHECKPOINT==E.hlck_valid){
+            if(E.hlck_valid==E.hlck_cap){
+                E.hlck_cap*=2;
+                E.hlck=realloc(E.hlck,E.hlck_cap);
+            }
+            E.hlck[E.hlck_valid++]=state;
+        }
+    }
+    E.page_keep=keep;
+    return state;
+}
+static inline __attribute__((always_inline))
+int editorSyntaxLex(erow* row,int i,int conv,int in_comment,const int numbers,const int strings){
+    /* the highlighter proper, from render column i to the end of the row. numbers and strings
+    are constants at every call, so each combination of HL_HIGHLIGHT_* gets a copy of its own
+    with the branches for what it lacks compiled away. the comment state at the end of the
+    row, or -1 if it converged with the old pass */
+    struct editorSyntax* syn=E.syntax;
+    const unsigned char* cls=syn->lex->cls;
+    char* scs=syn->singleline_comment_start;
+    char* mcs=syn->multiline_comment_start;
+    char* mce=syn->multiline_comment_end;
+    int scs_len=syn->lex->scs_len;
+    int mcs_len=syn->lex->mcs_len;
+    int mce_len=syn->lex->mce_len;
+    int ml=mcs_len && mce_len;
+    char* render=row->render;
+    unsigned char* hl=row->hl;
+    int rsize=row->rsize;
 
     int prev_sep=1;/* 1 means true here, and we consider the beginning of a line a seperator */
     int in_string=0;/* store either a double-quote (") or a single-quote (') character as the value of in_string */
-    int in_comment=(row->idx > 0 && E.row[row->idx-1].hl_open_comment);
-    /* means multicomment here */
-    
-    int i=0;
-    while(i<row->rsize){
-        char c=row->render[i];
-        unsigned char prev_hl=(i>0) ? row->hl[i-1] : HL_NORMAL;/* if it's the first char in the row */
+    while(i<rsize){
+        char c=render[i];
+        unsigned char k=cls[(unsigned char)c];
+
+        if(strings && in_string){/* comment markers mean nothing in a string */
+            hl[i]=HL_STRING;
+            if(c=='\\' && i+1<rsize){
+                hl[i+1]=HL_STRING;
+                i+=2;
+                continue;
+            }
+            if(c==in_string) in_string=0;
+            i++;
+            prev_sep=1;
+            continue;
+        }
+        if(ml && in_comment){/* nothing but the end marker matters, jump to its first byte */
+            char* p=memchr(&render[i],mce[0],rsize-i);
+            int end=p ? p-render : rsize;
+            memset(&hl[i],HL_MLCOMMENT,end-i);
+            i=end;
+            if(i==rsize) break;
+            if(i+mce_len<=rsize && !memcmp(&render[i],mce,mce_len)){
+                memset(&hl[i],HL_MLCOMMENT,mce_len);
+                in_comment=0;
+                prev_sep=1;
+                i+=mce_len;
+            }else{
+                hl[i++]=HL_MLCOMMENT;
+            }
+            continue;
+        }
 
-        if(scs_len && !in_string && !in_comment){/* not in the multipleline comment */
-            if(!strncmp(&row->render[i],scs,scs_len)){
-                memset(&row->hl[i],HL_COMMENT,row->rsize-i);
+        unsigned char prev_hl=(i>0) ? hl[i-1] : HL_NORMAL;/* if it's the first char in the row */
+        unsigned char old_hl=(i>=conv) ? hl[i] : HL_NORMAL;/* nothing wrote here yet in this pass */
+        if(k & LEX_TRIGGER){
+            if(scs_len && !in_comment && i+scs_len<=rsize && !memcmp(&render[i],scs,scs_len)){
+                memset(&hl[i],HL_COMMENT,rsize-i);
                 break;
             }
-        }
-        if(mcs_len && mce_len && !in_string){
-            if(in_comment){
-                row->hl[i]=HL_MLCOMMENT;
-                if(!strncmp(&row->render[i],mce,mce_len)){
-                    memset(&row->hl[i],HL_MLCOMMENT,mce_len);
-                    in_comment=0;
-                    prev_sep=1;
-                    i+=mce_len;
-                    continue;
-                }else{
-                    i++;
-                    continue;
-                }
-            }else if(!strncmp(&row->render[i],mcs,mcs_len)){
-                memset(&row->hl[i],HL_MLCOMMENT,mcs_len);
+            if(ml && i+mcs_len<=rsize && !memcmp(&render[i],mcs,mcs_len)){
+                memset(&hl[i],HL_MLCOMMENT,mcs_len);
                 in_comment=1;
                 i+=mcs_len;
                 continue;
             }
-        }
-
-        if(E.syntax->flags & HL_HIGHLIGHT_STRINGS){
-            if(in_string){
-                row->hl[i]=HL_STRING;
-                if(c=='\\' && i+1 < row->rsize){
-                    row->hl[i+1]=HL_STRING;
-                    i+=2;
-                    continue;
-                }
-                if(c==in_string) in_string=0;
+            if(strings && (c=='"' || c=='\'')){
+                in_string=c;
+                hl[i]=HL_STRING;
                 i++;
-                prev_sep=1;
                 continue;
-            }else{
-                if(c=='"' || c=='\''){
-                    in_string=c;
-                    row->hl[i]=HL_STRING;
-                    i++;
-                    continue;
-                }
-            } 
+            }
         }
 
-        if(E.syntax->flags & HL_HIGHLIGHT_NUMBERS){
-            if((isdigit(c) && (prev_sep || prev_hl==HL_NUMBER)) || 
+        if(numbers){
+            if(((k & LEX_DIGIT) && (prev_sep || prev_hl==HL_NUMBER)) ||
             (c=='.' && prev_hl==HL_NUMBER)){
-                row->hl[i]=HL_NUMBER;
+                hl[i]=HL_NUMBER;
                 prev_sep=0;
                 i++;
                 continue;
             }
         }
 
-        if(prev_sep){
-            int j;
-            for(j=0;keywords[j];j++){
-                int klen=strlen(keywords[j]);
-                int kw2=keywords[j][klen-1]=='|';
-                if(kw2) klen--;
-
-                if(!strncmp(keywords[j],&row->render[i],klen) && is_seperator(row->render[i+klen])){
-                    memset(&row->hl[i],kw2 ? HL_KEYWORD2 : HL_KEYWORD1,klen);
-                    i+=klen;
-                    break;
-                }
-            }
-
-            /* in the for loop, we check if keywords[j]!=NULL after every increment of j ,
-            so if none of the keywords match, we will stop when keywords[j]==NULL, 
-            so we use this to check if we've broken out from the loop*/
-            if(keywords[j]!=NULL){
+        if(prev_sep && (k & LEX_KW)){/* no keyword starts with any other byte */
+            int wlen=0;
+            while(i+wlen<rsize && !(cls[(unsigned char)render[i+wlen]] & LEX_SEP)) wlen++;
+            int kw=wlen ? editorSyntaxKeyword(&render[i],wlen) : HL_NORMAL;
+            if(kw!=HL_NORMAL){
+                memset(&hl[i],kw,wlen);
+                i+=wlen;
                 prev_sep=0;/* in the next loop, c will be the seperator after the keyword, so prev_sep=0 */
-                /* but why not just go to the char after the seperator??? */
                 continue;
             }
-
         }
 
-        prev_sep=is_seperator(c);
+        hl[i]=HL_NORMAL;
+        prev_sep=k & LEX_SEP;
         i++;
+        if(prev_sep){
+            if(i>conv && old_hl==HL_NORMAL) return -1;/* converged with the old pass */
+            /* more plain seperators (white space mostly) stay plain, short of conv where
+            every byte has to be checked for convergence */
+            while(i<conv && i<rsize && cls[(unsigned char)render[i]]==LEX_SEP) hl[i++]=HL_NORMAL;
+        }else{
+            /* inside a word: up to the next seperator or trigger every byte is plain text,
+            a digit too, its neighbour is neither a seperator nor a number */
+            while(i<rsize && !(cls[(unsigned char)render[i]] & (LEX_SEP|LEX_TRIGGER))) hl[i++]=HL_NORMAL;
+        }
+    }
+    return in_comment;
+}
+void editorSyntaxFrom(int filerow,int from,int conv){
+    /* highlight the row again starting around render column `from`. hl at and after `conv` is
+    the old highlighting of text that was only moved by the edit, so as soon as we are back in the
+    state the old pass had at such a column, the rest of the row (and hl_open_comment) stands */
+    erow* row=editorRowAt(filerow);
+    int known=row->flags & ROW_STATE_VALID;
+    row->flags|=ROW_HL_VALID|ROW_STATE_VALID;
+
+    if(E.syntax==NULL){
+        memset(&row->hl[from],HL_NORMAL,row->rsize-from);
+        row->hl_open_comment=0;
+        return;
+    }
 
+    /* a comment marker or keyword that ends at `from` may start up to `back` columns earlier.
+    from there walk back to a plain seperator: right after one we know the whole state,
+    not in a string, not in a comment, prev_sep set */
+    struct editorLexer* lex=E.syntax->lex;
+    int back=lex->scs_len;
+    if(lex->mcs_len>back) back=lex->mcs_len;
+    if(lex->mce_len>back) back=lex->mce_len;
+    if(E.syntax->kwtab->maxlen>back) back=E.syntax->kwtab->maxlen;
+    int i=from-back;
+    while(i>0 && !(row->hl[i-1]==HL_NORMAL && (lex->cls[(unsigned char)row->render[i-1]] & LEX_SEP))) i--;
+    if(i<0) i=0;
+    int in_comment=(i==0 && (row->flags & ROW_IN_COMMENT));
+    /* means multicomment here */
+
+    switch(E.syntax->flags & (HL_HIGHLIGHT_NUMBERS|HL_HIGHLIGHT_STRINGS)){
+        case 0: in_comment=editorSyntaxLex(row,i,conv,in_comment,0,0);break;
+        case HL_HIGHLIGHT_NUMBERS: in_comment=editorSyntaxLex(row,i,conv,in_comment,1,0);break;
+        case HL_HIGHLIGHT_STRINGS: in_comment=editorSyntaxLex(row,i,conv,in_comment,0,1);break;
+        default: in_comment=editorSyntaxLex(row,i,conv,in_comment,1,1);break;
     }
-    int changed=(row->hl_open_comment!=in_comment);
+    if(in_comment==-1) return;
+    int changed=(!known || row->hl_open_comment!=in_comment);
     row->hl_open_comment=in_comment;
-    if(changed && row->idx+1 < E.numrows)
-        editorUpdateSyntax(&E.row[row->idx+1]);
+    if(changed) editorSyntaxChanged(filerow);
+    /* no need to go on to the next row: it notices its incoming state changed when it is drawn */
+}
+void editorUpdateSyntax(int filerow){
+    long long t=editorProfNow();
+    int in_comment=editorSyntaxStateAt(filerow);
+    erow* row=editorRowAt(filerow);
+    if(!!(row->flags & ROW_IN_COMMENT)!=in_comment){
+        row->flags^=ROW_IN_COMMENT;
+        row->flags&=~ROW_STATE_VALID;
+    }
+    row->hl=realloc(row->hl,row->rsize);
+    editorSyntaxFrom(filerow,0,row->rsize);
+    editorProfEnd(PROF_SYNTAX,t);
 }
 void editorSelectSyntaxHighlight(){
     E.syntax=NULL;
@@ -397,9 +1362,12 @@ void editorSelectSyntaxHighlight(){
                 /* strcmp() returns 0 if two given strings are equal */
                 E.syntax=s;
 
-                int filerow;
-                for(filerow=0;filerow<E.numrows;filerow++){/* but???? seems only editorSave() need to do this */
-                    editorUpdateSyntax(&E.row[filerow]);
+                int filerow,n;
+                E.hlck_valid=1;
+                for(filerow=0;filerow<E.numrows;filerow+=n){/* only "Save as" gets here with rows loaded */
+                    erow* rows;
+                    n=editorRowSpan(filerow,&rows);
+                    for(int k=0;k<n;k++) rows[k].flags&=~(ROW_HL_VALID|ROW_STATE_VALID);/* redone when drawn */
                 }
                 return;
             }
@@ -422,167 +1390,1196 @@ int editorSyntaxToColor(int hl){
 }
 
 /* ***row operation*** */
-int editorRowCxToRx(erow* row,int cx){
-    int rx=0;
-    int j;
-    for(j=0;j<cx;j++){
-        if(row->chars[j]=='\t')
-            rx+=(KILO_TAB_STOP-1)-(j%KILO_TAB_STOP);
-        rx++;
-    }
-    return rx;
-}
-int editorRowRxToCx(erow* row,int rx){
-    int cur_rx=0;
-    int cx;
-    for(cx=0;cx<row->size;cx++){
-        if(row->chars[cx]=='\t')
-            cur_rx+=(KILO_TAB_STOP-1)-(cur_rx%KILO_TAB_STOP);
-        cur_rx++;
-        if(cur_rx>rx) return cx;/* if cur_rx==rx,we need to wait for the increment of cx in the for loop */
-    }
-    return cx;/* this line is normally useless */
-}
-void editorUpdateRow(erow *row){
-    int tabs=0;
-    int j;
-    for(j=0;j<row->size;j++){
-        if(row->chars[j]=='\t') tabs++;
+int editorRowTabIndex(erow* row,int cx){/* how many tabs come before cx */
+    int lo=0,hi=row->ntabs;
+    while(lo<hi){
+        int mid=(lo+hi)/2;
+        if(row->tabs[mid].cx<cx) lo=mid+1;
+        else hi=mid;
+    }
+    return lo;
+}
+int editorScanTabs(const char* s,int len,rowTab* out,int base){
+    /* count the tabs in s, and when out isn't NULL also store their positions (plus base) */
+    int n=0,i=0;
+#if defined(__AVX2__)
+    const __m256i tab32=_mm256_set1_epi8('\t');
+    for(;i+32<=len;i+=32){
+        unsigned int m=_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)&s[i]),tab32));
+        if(!out){
+            n+=__builtin_popcount(m);
+            continue;
+        }
+        while(m){
+            out[n++].cx=base+i+__builtin_ctz(m);
+            m&=m-1;
+        }
     }
+#endif
+#if defined(__SSE2__)
+    const __m128i tab16=_mm_set1_epi8('\t');
+    for(;i+16<=len;i+=16){
+        unsigned int m=_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)&s[i]),tab16));
+        if(!out){
+            n+=__builtin_popcount(m);
+            continue;
+        }
+        while(m){
+            out[n++].cx=base+i+__builtin_ctz(m);
+            m&=m-1;
+        }
+    }
+#endif
+    for(;i<len;i++){
+        if(s[i]!='\t') continue;
+        if(out) out[n].cx=base+i;
+        n++;
+    }
+    return n;
+}
+void editorRowCopy(erow* row,int from,int len,char* dst){/* chars[from..from+len) out through the gap */
+    if(from<row->gap){
+        int n=row->gap-from<len ? row->gap-from : len;
+        memcpy(dst,&row->chars[from],n);
+        dst+=n;
+        from+=n;
+        len-=n;
+    }
+    memcpy(dst,&row->chars[from+row->gaplen],len);
+}
+void editorUpdateRender(erow *row){
+    /* find the tabs first, then render is runs of chars copied between them */
+    int tail=row->size-row->gap;
+    int tabs=editorScanTabs(row->chars,row->gap,NULL,0)+editorScanTabs(&row->chars[row->gap+row->gaplen],tail,NULL,0);
+    free(row->tabs);
+    row->tabs=tabs ? malloc(tabs*sizeof(rowTab)) : NULL;
+    row->ntabs=tabs;
+    int n=editorScanTabs(row->chars,row->gap,row->tabs,0);
+    editorScanTabs(&row->chars[row->gap+row->gaplen],tail,&row->tabs[n],row->gap);
 
     free(row->render);
     row->render=malloc(row->size + tabs*(KILO_TAB_STOP-1) +1);
 
-    int idx=0;
-    for(j=0;j<row->size;j++){
-        if(row->chars[j]=='\t'){
+    int idx=0,j=0,k;
+    for(k=0;k<tabs;k++){
+        rowTab* t=&row->tabs[k];
+        editorRowCopy(row,j,t->cx-j,&row->render[idx]);
+        idx+=t->cx-j;
+        t->rx=idx;
+        row->render[idx++]=' ';
+        while(idx%KILO_TAB_STOP!=0) row->render[idx++]=' ';
+        j=t->cx+1;
+    }
+    editorRowCopy(row,j,row->size-j,&row->render[idx]);
+    idx+=row->size-j;
+    row->render[idx]='\0';
+    row->rsize=idx;
+    row->flags|=ROW_RENDER_VALID;
+    row->flags&=~ROW_HL_VALID;/* hl was for the old render */
+}
+int editorRowCxToRx(erow* row,int cx){
+    /* everything after the last tab before cx is one column wide */
+    if(!(row->flags & ROW_RENDER_VALID)) editorUpdateRender(row);
+    int k=editorRowTabIndex(row,cx);
+    if(k==0) return cx;
+    rowTab* t=&row->tabs[k-1];
+    return (t->rx/KILO_TAB_STOP+1)*KILO_TAB_STOP+(cx-t->cx-1);
+}
+void editorUpdateRow(int filerow){
+    /* the row changed as a whole: render, hl and its end state are redone when it is drawn */
+    editorRowAt(filerow)->flags&=~(ROW_RENDER_VALID|ROW_HL_VALID|ROW_STATE_VALID);
+    editorSyntaxChanged(filerow);
+}
+void editorRowPatch(int filerow,int cx,char* removed,int oldlen,int newlen){
+    /* chars[cx..cx+newlen) has just replaced the oldlen bytes in `removed`. rather than
+    rebuilding render, redo the columns of the new chars and of the run up to the next tab:
+    that tab soaks up the shift, so everything after it only moves as a block (by a multiple
+    of the tab stop), and the highlighter gets to reuse its old hl for it */
+    erow* row=editorRowAt(filerow);
+    if(!(row->flags & ROW_RENDER_VALID)){
+        editorUpdateRow(filerow);
+        return;
+    }
+    int rx0=(oldlen==0 && cx+newlen==row->size) ? row->rsize : editorRowCxToRx(row,cx);/* typing at the end is O(1) */
+    int a_old=rx0,a=rx0,j;
+    int old_t=0,new_t=0;/* tabs removed and added */
+    for(j=0;j<oldlen;j++){
+        if(removed[j]=='\t') old_t++;
+        a_old+=(removed[j]=='\t') ? KILO_TAB_STOP-a_old%KILO_TAB_STOP : 1;
+    }
+    for(j=cx;j<cx+newlen;j++){
+        if(ROW_CHAR(row,j)=='\t') new_t++;
+        a+=(ROW_CHAR(row,j)=='\t') ? KILO_TAB_STOP-a%KILO_TAB_STOP : 1;
+    }
+
+    /* old_end/new_end: where the untouched tail of render starts, before and after the edit */
+    int k=0,old_end=a_old,new_end=a;
+    int t0=editorRowTabIndex(row,cx);/* the tab index still describes the row before the edit */
+    int next=t0+old_t;
+    if(next<row->ntabs){
+        k=row->tabs[next].cx-(cx+oldlen);/* chars between the edit and the tab, they only move */
+        old_end=(a_old+k)/KILO_TAB_STOP*KILO_TAB_STOP+KILO_TAB_STOP;
+        new_end=(a+k)/KILO_TAB_STOP*KILO_TAB_STOP+KILO_TAB_STOP;
+    }
+    int rsize=row->rsize+new_end-old_end;
+    int tail=row->rsize-old_end;
+
+    /* moving in this order never overwrites bytes that still have to be moved */
+    if(new_end>old_end) row->render=realloc(row->render,rsize+1);
+    if(a<a_old) memmove(&row->render[a],&row->render[a_old],k);
+    memmove(&row->render[new_end],&row->render[old_end],tail+1);/* +1 is the nul */
+    if(a>a_old) memmove(&row->render[a],&row->render[a_old],k);
+    memset(&row->render[a+k],' ',new_end-a-k);
+    /* the tabs after the edit move like the text does */
+    int ntabs=row->ntabs-old_t+new_t;
+    if(new_t>old_t) row->tabs=realloc(row->tabs,ntabs*sizeof(rowTab));
+    if(next<row->ntabs) memmove(&row->tabs[t0+new_t],&row->tabs[next],(row->ntabs-next)*sizeof(rowTab));
+    row->ntabs=ntabs;
+    for(j=t0+new_t;j<ntabs;j++){
+        row->tabs[j].cx+=newlen-oldlen;
+        row->tabs[j].rx+=(j==t0+new_t) ? a-a_old : new_end-old_end;
+    }
+
+    int idx=rx0;
+    for(j=cx;j<cx+newlen;j++){
+        char c=ROW_CHAR(row,j);
+        if(c=='\t'){
+            row->tabs[t0].cx=j;
+            row->tabs[t0++].rx=idx;
             row->render[idx++]=' ';
             while(idx%KILO_TAB_STOP!=0) row->render[idx++]=' ';
         }else{
-            row->render[idx++]=row->chars[j];
+            row->render[idx++]=c;
         }
     }
-    row->render[idx]='\0';
-    row->rsize=idx;
-
-    editorUpdateSyntax(row);
+    row->rsize=rsize;
+
+    E.page_hold++;/* the edit may still be reading chars borrowed from some page */
+    int in_comment=editorSyntaxStateAt(filerow);
+    E.page_hold--;
+    if((row->flags & ROW_HL_VALID) && !!(row->flags & ROW_IN_COMMENT)==in_comment){
+        if(new_end>old_end) row->hl=realloc(row->hl,rsize);
+        if(tail) memmove(&row->hl[new_end],&row->hl[old_end],tail);/* hl may be NULL on an empty row */
+        editorSyntaxFrom(filerow,rx0,new_end);
+    }else{
+        row->flags&=~(ROW_HL_VALID|ROW_STATE_VALID);
+        editorSyntaxChanged(filerow);
+    }
+}
+void editorPrepareRow(int filerow){/* build render and hl on demand, right before the row is drawn */
+    int in_comment=editorSyntaxStateAt(filerow);
+    erow* row=editorRowAt(filerow);
+    if(!(row->flags & ROW_RENDER_VALID)) editorUpdateRender(row);
+    if((row->flags & ROW_HL_VALID) && !!(row->flags & ROW_IN_COMMENT)==in_comment) return;
+    editorUpdateSyntax(filerow);
+}
+void editorRowInit(erow* row){
+    row->size=0;
+    row->rsize=0;
+    row->chars=NULL;
+    row->render=NULL;
+    row->hl=NULL;
+    row->hl_open_comment=0;
+    row->flags=0;
+    row->gap=0;
+    row->gaplen=0;
+    row->tabs=NULL;
+    row->ntabs=0;
+}
+erow* editorNewRow(int at){/* open an empty slot at index at */
+    erow* row=ropeInsert(at);
+    editorRowInit(row);
+    E.numrows++;
+    return row;
 }
 void editorInsertRow(int at,char* s,size_t len){
     if(at<0 || at>E.numrows) return;
-
-    E.row=realloc(E.row,sizeof(erow)*(E.numrows+1));/* we need (currrent row number +1) rows */
-    memmove(&E.row[at+1],&E.row[at],sizeof(erow)*(E.numrows-at));
-    for(int j=at+1;j<=E.numrows;j++) E.row[j].idx++;
-
-    E.row[at].idx=at;
-    E.row[at].size=len;/* so size doesn't include the nul byte */
-    E.row[at].chars=malloc(len+1);
-    memcpy(E.row[at].chars,s,len);
-    E.row[at].chars[len]='\0';/* and the row.chars has (size+1) bytes */
-    E.numrows++;
-
-    E.row[at].rsize=0;
-    E.row[at].render=NULL;
-    E.row[at].hl=NULL;
-    E.row[at].hl_open_comment=0;
-    editorUpdateRow(&E.row[at]);
+    if(E.loading && at==E.numrows) editorLoadFinish();/* the end isn't the end yet */
+
+    editorCloseGap();/* E.gaprow is an index, keep it from going stale */
+    erow* row=editorNewRow(at);
+    row->size=len;/* so size doesn't include the nul byte */
+    row->chars=malloc(len+1);
+    memcpy(row->chars,s,len);
+    row->chars[len]='\0';/* and the row.chars has (size+1) bytes */
+    row->gap=len;
+    editorUpdateRow(at);
+    editorUndoRecord(UNDO_INSERT_ROW,at,0,s,len);
 
     E.dirty++;/* editorInsertChar() will call this if we need a new row. But why not put it in editorInsertChar()?? */
 }
+void editorSaveGarbage(char* chars){/* free chars once no save can be reading it */
+    if(!E.saving){
+        free(chars);
+        return;
+    }
+    if(E.save_ngarbage==E.save_garbagecap){
+        E.save_garbagecap=E.save_garbagecap ? E.save_garbagecap*2 : 64;
+        E.save_garbage=realloc(E.save_garbage,E.save_garbagecap*sizeof(char*));
+    }
+    E.save_garbage[E.save_ngarbage++]=chars;
+}
+void editorRowMakeWritable(erow* row){
+    /* copy a borrowed row out of the mapping, or a shared one away from the save, before the first edit */
+    if(!(row->flags & (ROW_BORROWED|ROW_SHARED))) return;
+    if(!(row->flags & ROW_BORROWED) && !E.saving){/* that save is over, the chars are ours alone again */
+        row->flags&=~ROW_SHARED;
+        return;
+    }
+    char* chars=malloc(row->size+1);
+    memcpy(chars,row->chars,row->size);
+    chars[row->size]='\0';
+    if(row->flags & ROW_SHARED) editorSaveGarbage(row->chars);
+    row->chars=chars;
+    row->gap=row->size;
+    row->gaplen=0;
+    row->flags&=~(ROW_BORROWED|ROW_SHARED);
+}
+erow* editorRowOpenGap(int filerow,int at,int need){
+    /* get row filerow ready for an edit at `at` that adds up to `need` bytes. moving the gap
+    only costs the distance the cursor travelled since the last edit, and the gap grows
+    geometrically, so a run of keystrokes is amortized O(1) whatever the line length */
+    if(E.gaprow!=filerow){
+        editorCloseGap();
+        E.gaprow=filerow;
+    }
+    erow* row=ropeRowOwn(filerow);
+    editorRowMakeWritable(row);
+    if(row->gaplen<need){
+        int gaplen=need+row->size/2+KILO_GAP_MIN;
+        int tail=row->size-row->gap;
+        row->chars=realloc(row->chars,row->size+gaplen+1);/* +1 leaves room for the nul of editorRowChars() */
+        memmove(&row->chars[row->gap+gaplen],&row->chars[row->gap+row->gaplen],tail);
+        row->gaplen=gaplen;
+    }
+    editorRowMoveGap(row,at);
+    return row;
+}
 void editorFreeRow(erow* row){
-    free(row->chars);
+    if(row->flags & ROW_SHARED) editorSaveGarbage(row->chars);
+    else if(!(row->flags & ROW_BORROWED)) free(row->chars);
     free(row->render);
     free(row->hl);
+    free(row->tabs);
 }
 void editorDelRow(int at){
     if(at<0 || at>=E.numrows) return;/* at (E.cy) counts from 0 and E.numrows counts from 1 */
-    editorFreeRow(&E.row[at]);
-    memmove(&E.row[at],&E.row[at+1],sizeof(erow)*(E.numrows-at-1));
-    for(int j=at;j<E.numrows-1;j++) E.row[j].idx--;
+    editorCloseGap();
+    erow* row=ropeRowOwn(at);/* so a save still reading its chars gets them marked ROW_SHARED */
+    editorUndoRecord(UNDO_DELETE_ROW,at,0,row->chars,row->size);
+    editorFreeRow(row);
+    ropeDelete(at);
     E.numrows--;
+    editorSyntaxChanged(at);
     E.dirty++;
 }
-void editorRowInsertChar(erow* row,int at,int c){
+void editorRowInsertChar(int filerow,int at,int c){
+    erow* row=editorRowAt(filerow);
     if(at<0||at>row->size) at=row->size;       //but at will never be negative. why check here?
-    row->chars=realloc(row->chars,row->size+2);//row->size doesn't count the nul byte
-    memmove(&row->chars[at+1],&row->chars[at],row->size-at+1);
+    row=editorRowOpenGap(filerow,at,1);
+    row->chars[row->gap++]=c;
+    row->gaplen--;
     row->size++;
-    row->chars[at]=c;
-    editorUpdateRow(row);
+    editorRowPatch(filerow,at,NULL,0,1);
+    char ch=c;
+    editorUndoRecord(UNDO_INSERT_TEXT,filerow,at,&ch,1);
 
     E.dirty++;
 }
-void editorRowAppendString(erow* row,char* s,size_t len){
-    row->chars=realloc(row->chars,row->size+len+1);
-    memcpy(&row->chars[row->size],s,len);
-    row->size+=len;
-    row->chars[row->size]='\0';
-    editorUpdateRow(row);
-    E.dirty++;
+void editorRowInsertString(int filerow,int at,char* s,size_t len){
+    erow* row=editorRowOpenGap(filerow,at,len);
+    memcpy(&row->chars[row->gap],s,len);
+    row->gap+=len;
+    row->gaplen-=len;
+    row->size+=len;
+    editorRowPatch(filerow,at,NULL,0,len);
+    editorUndoRecord(UNDO_INSERT_TEXT,filerow,at,s,len);
+    E.dirty++;
+}
+void editorRowAppendString(int filerow,char* s,size_t len){
+    editorRowInsertString(filerow,editorRowAt(filerow)->size,s,len);
+}
+void editorRowDelChar(int filerow,int at){
+    erow* row=editorRowAt(filerow);
+    if(at<0 || at>=row->size) return;
+    char c=ROW_CHAR(row,at);
+    row=editorRowOpenGap(filerow,at,0);
+    row->gaplen++;/* the char right after the gap is now part of it */
+    row->size--;
+    editorRowPatch(filerow,at,&c,1,0);
+    editorUndoRecord(UNDO_DELETE_TEXT,filerow,at,&c,1);
+    E.dirty++;
+}
+void editorRowDelString(int filerow,int at,int len){/* drop chars[at..at+len) */
+    erow* row=editorRowAt(filerow);
+    if(at<0 || len<=0 || at+len>row->size) return;
+    char* removed=malloc(len);
+    editorRowCopy(row,at,len,removed);
+    row=editorRowOpenGap(filerow,at,0);
+    row->gaplen+=len;
+    row->size-=len;
+    editorRowPatch(filerow,at,removed,len,0);
+    editorUndoRecord(UNDO_DELETE_TEXT,filerow,at,removed,len);
+    free(removed);
+    E.dirty++;
+}
+
+/* ***editor operations*** */
+void editorInsertChar(int c){
+    if(E.cy==E.numrows){
+        editorInsertRow(E.numrows,"",0);
+    }
+    editorRowInsertChar(E.cy,E.cx,c);
+    E.cx++;
+}
+void editorInsertNewLine(){
+    if(E.cx==0){
+        editorInsertRow(E.cy,"",0);
+    }else{
+        erow* row=editorRowAt(E.cy);
+        char* chars=editorRowChars(row);
+        editorInsertRow(E.cy+1,&chars[E.cx],row->size-E.cx);
+        row=editorRowAt(E.cy);/* !!editorInsertRow() may split the leaf, which moves the row */
+        editorRowDelString(E.cy,E.cx,row->size-E.cx);/* the cut off tail becomes gap */
+    }
+    E.cx=0;
+    E.cy++;
+}
+int editorLineEnd(char* s,int len,int* brk){/* length of the first line of s, *brk is set to the size of its line break */
+    int i;
+    for(i=0;i<len;i++){
+        if(s[i]=='\n' || s[i]=='\r'){
+            *brk=(s[i]=='\r' && i+1<len && s[i+1]=='\n') ? 2 : 1;/* \r\n, \r or \n */
+            return i;
+        }
+    }
+    *brk=0;
+    return len;
+}
+void editorInsertText(char* s,int len){
+    /* insert a whole paste at the cursor. the text is cut into lines once and every line
+    is copied straight into its own row, so this is O(len) however many lines it has */
+    if(len==0) return;
+    int brk;
+    int n=editorLineEnd(s,len,&brk);
+    while(E.cy==E.numrows){/* as when typed: on the line past the end, a line break just adds an empty row above */
+        if(len==0) return;
+        if(n>0 || brk==0){
+            editorInsertRow(E.numrows,"",0);
+            break;
+        }
+        editorInsertRow(E.cy++,"",0);
+        s+=brk;
+        len-=brk;
+        n=editorLineEnd(s,len,&brk);
+    }
+    if(brk==0){
+        editorRowInsertString(E.cy,E.cx,s,len);
+        E.cx+=len;
+        return;
+    }
+
+    /* the part of the cursor row right of the cursor goes after the last pasted line */
+    erow* row=editorRowAt(E.cy);
+    char* chars=editorRowChars(row);
+    int taillen=row->size-E.cx;
+    char* tail=malloc(taillen+1);
+    memcpy(tail,&chars[E.cx],taillen);
+    editorRowDelString(E.cy,E.cx,taillen);
+    editorRowAppendString(E.cy,s,n);
+
+    int at=E.cy+1;
+    s+=n+brk;
+    len-=n+brk;
+    while(1){
+        n=editorLineEnd(s,len,&brk);
+        if(brk==0) break;
+        editorInsertRow(at++,s,n);
+        s+=n+brk;
+        len-=n+brk;
+    }
+    char* last=malloc(len+taillen+1);
+    memcpy(last,s,len);
+    memcpy(&last[len],tail,taillen);
+    editorInsertRow(at,last,len+taillen);
+    free(last);
+    free(tail);
+    E.cy=at;
+    E.cx=len;
+}
+void editorDelChar(){/* is actually backspace,and delete is based on backspace*/
+    if(E.cy==E.numrows) return;
+    if(E.cx==0 && E.cy==0) return;
+    if(E.cx>0){
+        editorRowDelChar(E.cy,E.cx-1);
+        E.cx--;
+    }else{
+        erow *row=editorRowAt(E.cy);
+        E.cx=editorRowAt(E.cy-1)->size;
+        editorRowAppendString(E.cy-1,editorRowChars(row),row->size);
+        editorDelRow(E.cy);
+        E.cy--;
+    }
+}
+
+/* ***undo*** */
+/* the journal records the primitive edits as they happen, not copies of rows, so undoing
+a step costs what the step did whatever the size of the file. ops of a run of typing or
+erasing are merged as they come, and the oldest steps go once the journal is over its cap */
+long long editorUndoUsed(){/* bytes the live part of the journal takes */
+    long long text=E.undo_end-(E.undo_head<E.undo_n ? E.undo[E.undo_head].off : E.undo_end);
+    return (long long)(E.undo_n-E.undo_head)*sizeof(undoOp)+text;
+}
+void editorUndoClear(){
+    E.undo_head=E.undo_cur=E.undo_n=0;
+    E.undo_base=E.undo_end;
+    E.undo_step=-1;
+}
+void editorUndoTrim(){
+    /* drop whole steps from the front until the journal fits. the step being recorded
+    stays, unless it is too big by itself: then nothing before it can be undone anyway */
+    while(editorUndoUsed()>E.undo_limit && E.undo_head<E.undo_step){
+        do E.undo_head++;
+        while(E.undo_head<E.undo_step && !(E.undo[E.undo_head].flags & UNDO_STEP));
+    }
+    if(editorUndoUsed()>E.undo_limit){
+        editorUndoClear();
+        E.undo_off=1;/* until the next key */
+        editorSetStatusMessage("Edit too big to undo");
+    }
+    /* the dropped part of both arrays is reused once it is the bigger half */
+    if(E.undo_head>0 && E.undo_head>=E.undo_n-E.undo_head){
+        memmove(E.undo,&E.undo[E.undo_head],(E.undo_n-E.undo_head)*sizeof(undoOp));
+        E.undo_n-=E.undo_head;
+        E.undo_cur-=E.undo_head;
+        if(E.undo_step!=-1) E.undo_step-=E.undo_head;
+        E.undo_head=0;
+    }
+    long long live=(E.undo_head<E.undo_n) ? E.undo[E.undo_head].off : E.undo_end;
+    if(live-E.undo_base>0 && live-E.undo_base>=E.undo_end-live){
+        memmove(E.undo_arena,&E.undo_arena[live-E.undo_base],E.undo_end-live);
+        E.undo_base=live;
+    }
+}
+void editorUndoRecord(int type,int row,int col,char* s,int len){
+    if(E.undo_off) return;
+    if(E.undo_cur<E.undo_n){/* a new edit, what was undone can't be redone anymore */
+        E.undo_end=E.undo[E.undo_cur].off;
+        E.undo_n=E.undo_cur;
+    }
+    undoOp* top=(E.undo_step!=-1 && E.undo_n>E.undo_step) ? &E.undo[E.undo_n-1] : NULL;
+    int merge=0;
+    if(top && top->type==type && top->row==row){
+        if(type==UNDO_INSERT_TEXT && col==top->col+top->len){
+            merge=1;/* typing on */
+        }else if(type==UNDO_DELETE_TEXT && col==top->col && !(top->flags & UNDO_BACKWARD)){
+            merge=1;/* delete, delete... */
+        }else if(type==UNDO_DELETE_TEXT && len==1 && col+1==top->col && (top->len==1 || (top->flags & UNDO_BACKWARD))){
+            merge=1;/* backspace, backspace... */
+            top->flags|=UNDO_BACKWARD;
+            top->col=col;
+        }
+    }
+
+    if(E.undo_end+len-E.undo_base>E.undo_arenacap){
+        E.undo_arenacap=2*(E.undo_end+len-E.undo_base)+4096;
+        E.undo_arena=realloc(E.undo_arena,E.undo_arenacap);
+    }
+    if(len>0) memcpy(&E.undo_arena[E.undo_end-E.undo_base],s,len);
+    if(merge){
+        top->len+=len;/* its text is the last one in the arena, so it just grows */
+    }else{
+        if(E.undo_n==E.undo_cap){
+            E.undo_cap=E.undo_cap ? E.undo_cap*2 : 256;
+            E.undo=realloc(E.undo,E.undo_cap*sizeof(undoOp));
+        }
+        undoOp* op=&E.undo[E.undo_n];
+        op->type=type;
+        op->flags=0;
+        op->row=row;
+        op->col=col;
+        op->len=len;
+        op->off=E.undo_end;
+        if(E.undo_step==-1){
+            E.undo_step=E.undo_n;
+            op->flags=UNDO_STEP;
+            op->cx=op->acx=E.undo_cx;
+            op->cy=op->acy=E.undo_cy;
+        }
+        E.undo_n++;
+    }
+    E.undo_end+=len;
+    E.undo_cur=E.undo_n;
+    editorUndoTrim();
+}
+void editorUndoBegin(int kind){
+    /* called for every key before it is acted on. kind is 1 for typing, 2 for erasing
+    and 0 for anything else: a key that is not of the kind of the last one ends its step */
+    E.undo_off=0;
+    if(E.undo_step!=-1 && (kind==0 || kind!=E.undo_kind)){
+        E.undo[E.undo_step].acx=E.cx;
+        E.undo[E.undo_step].acy=E.cy;
+        E.undo_step=-1;
+    }
+    E.undo_kind=kind;
+    E.undo_cx=E.cx;
+    E.undo_cy=E.cy;
+}
+void editorUndoApply(undoOp* op,int forward){
+    /* redo op, or undo it when !forward */
+    char* s=&E.undo_arena[op->off-E.undo_base];
+    int insert=(op->type==UNDO_INSERT_TEXT || op->type==UNDO_INSERT_ROW)==forward;
+    if(op->type==UNDO_INSERT_ROW || op->type==UNDO_DELETE_ROW){
+        if(insert) editorInsertRow(op->row,s,op->len);
+        else editorDelRow(op->row);
+    }else if(!insert){
+        editorRowDelString(op->row,op->col,op->len);
+    }else if(op->flags & UNDO_BACKWARD){
+        char* text=malloc(op->len);
+        int j;
+        for(j=0;j<op->len;j++) text[j]=s[op->len-1-j];
+        editorRowInsertString(op->row,op->col,text,op->len);
+        free(text);
+    }else{
+        editorRowInsertString(op->row,op->col,s,op->len);
+    }
+}
+void editorUndo(){
+    if(E.undo_cur==E.undo_head){
+        editorSetStatusMessage("Nothing to undo");
+        return;
+    }
+    E.undo_off=1;
+    do{
+        E.undo_cur--;
+        editorUndoApply(&E.undo[E.undo_cur],0);
+    }while(!(E.undo[E.undo_cur].flags & UNDO_STEP));
+    E.undo_off=0;
+    E.cx=E.undo[E.undo_cur].cx;
+    E.cy=E.undo[E.undo_cur].cy;
+}
+void editorRedo(){
+    if(E.undo_cur==E.undo_n){
+        editorSetStatusMessage("Nothing to redo");
+        return;
+    }
+    int step=E.undo_cur;
+    E.undo_off=1;
+    do{
+        editorUndoApply(&E.undo[E.undo_cur],1);
+        E.undo_cur++;
+    }while(E.undo_cur<E.undo_n && !(E.undo[E.undo_cur].flags & UNDO_STEP));
+    E.undo_off=0;
+    E.cx=E.undo[step].acx;
+    E.cy=E.undo[step].acy;
+}
+
+/* ***file i/o*** */
+int editorWriteAll(int fd,struct iovec* iov,int n){/* writev() until all of iov is out, -1 on error */
+    while(n>0){
+        ssize_t w=writev(fd,iov,n);
+        if(w==-1){
+            if(errno==EINTR) continue;
+            return -1;
+        }
+        while(n>0 && (size_t)w>=iov->iov_len){
+            w-=iov->iov_len;
+            iov++;
+            n--;
+        }
+        if(n>0){/* a short write stopped inside this one */
+            iov->iov_base=(char*)iov->iov_base+w;
+            iov->iov_len-=w;
+        }
+    }
+    return 0;
+}
+typedef struct saveBatch{
+    int fd;
+    struct iovec iov[KILO_SAVE_IOV];
+    int niov;
+    long long from,to;/* a run of pages, bytes of the file still to be copied out */
+    char* buf;
+    long long total;
+}saveBatch;
+int editorWriteRange(saveBatch* b){
+    /* copy the pending run of pages from the file, or write it from the mapping. editorSplitRows()
+    takes any \r before a newline off a row and edited rows go out with a bare \n, so a page
+    has its \r\n turned into \n on the way too, else a save would mix the two */
+    long long off=b->from;
+    long long cr=0;/* \r at the end of what was read, kept back until the next byte is known */
+    char last='\n';
+    while(off<b->to){
+        long long want=b->to-off;
+        char* s=b->buf;
+        ssize_t r=want<KILO_PAGE_READ ? want : KILO_PAGE_READ;
+        if(E.paging) r=pread(E.page_fd,b->buf,r,off);
+        else if(memchr(E.map+off,'\r',r)) memcpy(b->buf,E.map+off,r);/* the \r are taken out in place */
+        else s=E.map+off;
+        if(r==-1 && errno==EINTR) continue;
+        if(r<=0){
+            if(r==0) errno=EIO;/* the file got shorter */
+            return -1;
+        }
+        off+=r;
+        ssize_t i,w=r;
+        if(cr>0){/* the \r kept back go out unless the line ends after them */
+            for(i=0;i<r && s[i]=='\r';i++);
+            if(i==r){
+                cr+=r;
+                continue;
+            }
+            for(;s[i]!='\n' && cr>0;cr--){
+                struct iovec v={"\r",1};
+                if(editorWriteAll(b->fd,&v,1)==-1) return -1;
+                b->total++;
+            }
+            cr=0;
+        }
+        if(memchr(s,'\r',r)){
+            for(i=w=0;i<r;i++){/* w never passes i, the \r put back were skipped before it */
+                if(s[i]=='\r'){
+                    cr++;
+                    continue;
+                }
+                for(;s[i]!='\n' && cr>0;cr--) s[w++]='\r';
+                cr=0;
+                s[w++]=s[i];
+            }
+        }
+        if(w>0){
+            struct iovec v={s,w};
+            if(editorWriteAll(b->fd,&v,1)==-1) return -1;
+            b->total+=w;
+            last=s[w-1];
+        }
+    }
+    b->from=b->to=0;
+    if(cr>0) last='\r';/* the file ends in \r, a line of its own or the end of one */
+    if(last!='\n'){/* the last line of the file had none */
+        struct iovec v={"\n",1};
+        if(editorWriteAll(b->fd,&v,1)==-1) return -1;
+        b->total++;
+    }
+    return 0;
+}
+int editorWriteLeaves(saveBatch* b,ropeNode* node){
+    /* queue every row below node, straight from where it lives. a row still borrowed from
+    the mapping goes out with the newline that follows it there, so runs of untouched rows
+    merge into one iovec. only chars and size are read, the main thread may be updating
+    the rest of the row meanwhile */
+    static char nl='\n';
+    int k;
+    if(!node->leaf){
+        for(k=0;k<node->n;k++){
+            if(editorWriteLeaves(b,node->child[k])==-1) return -1;
+        }
+        return 0;
+    }
+    if(node->off>=0){
+        /* a page is as it is in the file, whether it is read in or not: only off and len
+        are looked at, they never change while a save holds the page */
+        if(b->niov>0 && editorWriteAll(b->fd,b->iov,b->niov)==-1) return -1;
+        b->niov=0;
+        if(b->to!=node->off){
+            if(b->to>b->from && editorWriteRange(b)==-1) return -1;
+            b->from=b->to=node->off;
+        }
+        b->to+=node->len;
+        return 0;
+    }
+    if(b->to>b->from && editorWriteRange(b)==-1) return -1;
+    for(k=0;k<node->n;k++){
+        char* chars=node->row[k].chars;
+        size_t size=node->row[k].size;
+        int mapnl=E.map && chars>=E.map && chars+size<E.map+E.maplen && chars[size]=='\n';
+        if(b->niov>KILO_SAVE_IOV-2){
+            if(editorWriteAll(b->fd,b->iov,b->niov)==-1) return -1;
+            b->niov=0;
+        }
+        struct iovec* last=b->niov>0 ? &b->iov[b->niov-1] : NULL;
+        if(mapnl && last && (char*)last->iov_base+last->iov_len==chars){
+            last->iov_len+=size+1;
+        }else if(mapnl){
+            b->iov[b->niov].iov_base=chars;
+            b->iov[b->niov++].iov_len=size+1;
+        }else{
+            if(size>0){
+                b->iov[b->niov].iov_base=chars;
+                b->iov[b->niov++].iov_len=size;
+            }
+            b->iov[b->niov].iov_base=&nl;
+            b->iov[b->niov++].iov_len=1;
+        }
+        b->total+=size+1;
+    }
+    return 0;
+}
+long long editorWriteRows(int fd,ropeNode* root){
+    /* write the rows of the tree out with batched writev(), no copy of the buffer is
+    made. every row must be in one piece. returns the bytes written, -1 on error */
+    saveBatch* b=malloc(sizeof(saveBatch));
+    b->fd=fd;
+    b->niov=0;
+    b->from=b->to=0;
+    b->buf=(E.paging || E.map) ? malloc(KILO_PAGE_READ) : NULL;
+    b->total=0;
+    long long total=-1;
+    if(editorWriteLeaves(b,root)!=-1 && (b->niov==0 || editorWriteAll(fd,b->iov,b->niov)!=-1) &&
+    (b->to==b->from || editorWriteRange(b)!=-1)) total=b->total;
+    free(b->buf);
+    free(b);
+    return total;
+}
+unsigned int editorNewlines(const char* s){/* bit i is set if s[i] is a newline, for the 32 bytes at s */
+#if defined(__AVX2__)
+    return _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)s),_mm256_set1_epi8('\n')));
+#elif defined(__SSE2__)
+    const __m128i nl=_mm_set1_epi8('\n');
+    unsigned int lo=_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)s),nl));
+    unsigned int hi=_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(s+16)),nl));
+    return lo|hi<<16;
+#else
+    unsigned int m=0;
+    int i;
+    for(i=0;i<32;i++) m|=(unsigned int)(s[i]=='\n')<<i;
+    return m;
+#endif
+}
+char* editorSplitRows(ropeNode* leaf,char* p,char* end,int last){
+    /* fill up the leaf with rows borrowing the lines that start at p, and return where the
+    next line starts. nothing is copied or rendered. the newlines are found 32 bytes at a
+    time, one compare and movemask for a run of short lines where memchr() would be called
+    once per line. a line with no newline before end is only taken if it is the last */
+    char* scan=p;/* the newlines before scan are in mask already */
+    char* base=p;
+    unsigned int mask=0;
+    while(leaf->n<ROPE_LEAF_ROWS){
+        char* nl;
+        if(mask){
+            nl=base+__builtin_ctz(mask);
+            mask&=mask-1;
+        }else if(end-scan>=32){
+            base=scan;
+            mask=editorNewlines(base);
+            scan+=32;
+            continue;
+        }else{
+            nl=memchr(scan,'\n',end-scan);/* the last few bytes */
+            if(!nl){
+                if(!last || p==end) break;
+                nl=end;
+            }
+            scan=nl<end ? nl+1 : end;
+        }
+        erow* row=&leaf->row[leaf->n++];
+        size_t linelen=nl-p;
+        while(linelen>0 && p[linelen-1]=='\r') linelen--;
+        editorRowInit(row);
+        row->size=linelen;
+        row->chars=p;
+        row->gap=linelen;
+        row->flags=ROW_BORROWED;
+        p=nl<end ? nl+1 : end;
+    }
+    return p;
+}
+void editorLoadHandOver(ropeNode** batch,int n,long long pos){/* the loader gives leaves to the main thread */
+    pthread_mutex_lock(&E.load_mutex);
+    if(E.load_nready+n>E.load_readycap){
+        while(E.load_nready+n>E.load_readycap) E.load_readycap=E.load_readycap ? E.load_readycap*2 : KILO_LOAD_BATCH;
+        E.load_ready=realloc(E.load_ready,sizeof(ropeNode*)*E.load_readycap);
+    }
+    memcpy(&E.load_ready[E.load_nready],batch,sizeof(ropeNode*)*n);
+    int wake=E.load_nready==0;/* else the main thread has a wake-up pending already */
+    E.load_nready+=n;
+    E.load_pos=pos;
+    pthread_mutex_unlock(&E.load_mutex);
+    if(wake && write(E.load_pipe[1],"",1)==-1){}
+}
+void editorLoadDone(){
+    pthread_mutex_lock(&E.load_mutex);
+    E.load_done=1;
+    pthread_mutex_unlock(&E.load_mutex);
+    if(write(E.load_pipe[1],"",1)==-1){}
+}
+char* editorMapPage(char* p,char* end,ropeNode** out){
+    /* a page of the mapping for the lines at p, up to ROPE_LEAF_ROWS of them: their
+    newlines are counted 32 bytes at a time, no row is made. returns where the next starts */
+    ropeNode* leaf=editorPageNew(p-E.map);
+    char* q=p;
+    while(leaf->n<ROPE_LEAF_ROWS && q<end){
+        if(end-q>=32){
+            unsigned int mask=editorNewlines(q);
+            int need=ROPE_LEAF_ROWS-leaf->n;
+            if(__builtin_popcount(mask)<need){
+                leaf->n+=__builtin_popcount(mask);
+                q+=32;
+                continue;
+            }
+            while(--need>0) mask&=mask-1;
+            q+=__builtin_ctz(mask)+1;
+            leaf->n=ROPE_LEAF_ROWS;
+            break;
+        }
+        char* nl=memchr(q,'\n',end-q);/* the last few bytes */
+        if(!nl){
+            q=end;
+            break;
+        }
+        leaf->n++;
+        q=nl+1;
+    }
+    if(q==end && end[-1]!='\n') leaf->n++;/* the last line has no newline */
+    leaf->len=q-p;
+    leaf->count=leaf->n;
+    *out=leaf;
+    return q;
+}
+void* editorLoadWalk(void* arg){
+    /* the loader thread: cuts the mapping into pages off to the side and hands them over
+    in batches, E.rows itself is only ever touched by the main thread */
+    char* p=arg;
+    char* end=E.map+E.maplen;
+    ropeNode* batch[KILO_LOAD_BATCH];
+    while(p<end){
+        int n=0;
+        while(n<KILO_LOAD_BATCH && p<end) p=editorMapPage(p,end,&batch[n++]);
+        editorLoadHandOver(batch,n,p-E.map);
+    }
+    editorLoadDone();
+    return NULL;
+}
+/* the loader only notes where each run of ROPE_LEAF_ROWS lines starts in the file, and a
+leaf made of such a run is a page: its rows are made when they are first looked at. a mapped
+file's pages keep their rows from then on, they borrow from the mapping. with -m the file is
+paged rather than mapped: a page is read in with pread(), and dropped again, the least
+recently used first, once the pages read in take more than E.page_limit. what a page
+takes counts its rows and their render, hl and tabs too, see editorPageCount(). an edit turns
+a page into an ordinary leaf that keeps its rows for good, so the edits are an overlay
+on the file, and a save copies the untouched pages straight from it */
+ropeNode* editorPageNew(long long off){
+    ropeNode* leaf=calloc(1,sizeof(ropeNode));
+    leaf->leaf=1;
+    leaf->ref=1;
+    leaf->off=off;
+    return leaf;
+}
+long long editorPageExtra(ropeNode* leaf){/* what drawing or searching its rows has added to a page */
+    long long n=0;
+    int j;
+    for(j=0;j<leaf->n;j++){
+        erow* row=&leaf->row[j];
+        if(row->render) n+=row->rsize+1;
+        if(row->hl) n+=row->rsize;
+        n+=row->ntabs*sizeof(rowTab);
+    }
+    return n;
+}
+void editorPageCount(ropeNode* leaf){
+    /* bring E.page_bytes up to date for the page. rows are only built on right after their
+    page was looked up, so it is enough to count the newest page before it loses its place */
+    long long extra=editorPageExtra(leaf);
+    E.page_bytes+=extra-leaf->extra;
+    leaf->extra=extra;
+}
+void editorPageLink(ropeNode* leaf){/* first in the list, it is the most recently used */
+    if(E.page_newest) editorPageCount(E.page_newest);
+    leaf->newer=NULL;
+    leaf->older=E.page_newest;
+    if(E.page_newest) E.page_newest->newer=leaf;
+    else E.page_oldest=leaf;
+    E.page_newest=leaf;
+}
+void editorPageUnlink(ropeNode* leaf){
+    if(leaf->newer) leaf->newer->older=leaf->older;
+    else E.page_newest=leaf->older;
+    if(leaf->older) leaf->older->newer=leaf->newer;
+    else E.page_oldest=leaf->newer;
+}
+void editorPageMap(ropeNode* leaf){
+    /* a page of the mapping gets its rows. worker threads may do this at the same time, so
+    the rows are made off to the side and the first to be done puts them in place */
+    ropeNode rows;
+    rows.row=malloc(sizeof(erow)*ROPE_LEAF_ROWS);
+    rows.n=0;
+    char* page=E.map+leaf->off;
+    editorSplitRows(&rows,page,page+leaf->len,1);
+    while(rows.n<leaf->n) editorRowInit(&rows.row[rows.n++]);
+    erow* none=NULL;
+    if(__atomic_compare_exchange_n(&leaf->row,&none,rows.row,0,__ATOMIC_RELEASE,__ATOMIC_ACQUIRE)){
+        leaf->page=page;
+    }else{
+        free(rows.row);
+    }
+}
+void editorPageIn(ropeNode* leaf){
+    if(!E.paging){
+        editorPageMap(leaf);
+        return;
+    }
+    char* page=malloc(leaf->len);
+    long long got=0;
+    while(got<leaf->len){
+        ssize_t r=pread(E.page_fd,page+got,leaf->len-got,leaf->off+got);
+        if(r==-1 && errno==EINTR) continue;
+        if(r<=0) die("pread");/* the file was cut short under us, the rows can't be made up */
+        got+=r;
+    }
+    leaf->row=malloc(sizeof(erow)*ROPE_LEAF_ROWS);
+    int n=leaf->n;
+    leaf->n=0;
+    editorSplitRows(leaf,page,page+leaf->len,1);
+    while(leaf->n<n) editorRowInit(&leaf->row[leaf->n++]);/* only if the file changed under us */
+    leaf->n=n;
+    leaf->page=page;
+    editorPageLink(leaf);
+    E.page_bytes+=leaf->len+sizeof(erow)*ROPE_LEAF_ROWS;
+}
+void editorPageUse(ropeNode* leaf){/* read the page in, or move it up the list */
+    if(!E.paging){/* a page of the mapping is in no list, and may be looked at by workers */
+        if(!__atomic_load_n(&leaf->row,__ATOMIC_ACQUIRE)) editorPageMap(leaf);
+        return;
+    }
+    if(leaf->row==NULL){
+        editorPageIn(leaf);
+    }else if(E.page_newest!=leaf){
+        editorPageUnlink(leaf);
+        editorPageLink(leaf);
+    }
+}
+void editorPageDrop(ropeNode* leaf){
+    /* an edit is done with the page. its bytes are freed by editorPageTrim() between keys,
+    an edit may still be copying chars it borrowed from them, as from the mapping */
+    if(!E.paging){/* the mapping stays, the rows may go on borrowing from it */
+        leaf->page=NULL;
+        return;
+    }
+    editorPageUnlink(leaf);
+    E.page_bytes-=leaf->len+sizeof(erow)*ROPE_LEAF_ROWS+leaf->extra;
+    leaf->extra=0;
+    if(E.page_ngarbage==E.page_garbagecap){
+        E.page_garbagecap=E.page_garbagecap ? E.page_garbagecap*2 : 16;
+        E.page_garbage=realloc(E.page_garbage,E.page_garbagecap*sizeof(char*));
+    }
+    E.page_garbage[E.page_ngarbage++]=leaf->page;
+    leaf->page=NULL;
 }
-void editorRowDelChar(erow* row,int at){
-    if(at<0 || at>=row->size) return;
-    memmove(&row->chars[at],&row->chars[at+1],row->size-at);
-    row->size--;
-    editorUpdateRow(row);
-    E.dirty++;
+void editorPageForget(ropeNode* leaf){
+    /* let go of the page read in. what its rows point to is either freed already or
+    belongs to some other leaf now */
+    editorPageDrop(leaf);
+    free(leaf->row);
+    leaf->row=NULL;
 }
-
-/* ***editor operations*** */
-void editorInsertChar(int c){
-    if(E.cy==E.numrows){
-        editorInsertRow(E.numrows,"",0);
+void editorPageTrim(){
+    /* drop the least recently used pages until the rest fits. only where no erow pointer
+    is held across the call, but of E.page_keep: a row is gone with its page */
+    int j;
+    if(E.page_newest) editorPageCount(E.page_newest);
+    ropeNode* leaf=E.page_oldest;
+    while(E.page_bytes>E.page_limit && leaf && !E.page_hold){
+        ropeNode* newer=leaf->newer;
+        if(leaf==E.page_keep){
+            leaf=newer;
+            continue;
+        }
+        for(j=0;j<leaf->n;j++) editorFreeRow(&leaf->row[j]);
+        editorPageUnlink(leaf);
+        E.page_bytes-=leaf->len+sizeof(erow)*ROPE_LEAF_ROWS+leaf->extra;
+        leaf->extra=0;
+        free(leaf->page);
+        free(leaf->row);
+        leaf->page=NULL;
+        leaf->row=NULL;
+        leaf=newer;
     }
-    editorRowInsertChar(&E.row[E.cy],E.cx,c);
-    E.cx++;
 }
-void editorInsertNewLine(){
-    if(E.cx==0){
-        editorInsertRow(E.cy,"",0);
-    }else{
-        erow* row=&E.row[E.cy];
-        editorInsertRow(E.cy+1,&row->chars[E.cx],row->size-E.cx);
-        row=&E.row[E.cy];/* !!editorInsertRow() calls realloc(),which may change E.row */
-        row->size=E.cx;
-        row->chars[row->size]='\0';/* do not forget this */
-        editorUpdateRow(row);
+void editorPageCollect(){/* between keys, when no edit is using a page anymore */
+    int j;
+    for(j=0;j<E.page_ngarbage;j++) free(E.page_garbage[j]);
+    E.page_ngarbage=0;
+}
+void editorPageOwn(ropeNode* leaf){
+    /* a leaf of ours is about to change: its rows get chars of their own, and if it was a
+    page it is one no more */
+    if(leaf->off>=0 && leaf->row==NULL) editorPageIn(leaf);
+    int j;
+    for(j=0;E.paging && j<leaf->n;j++){/* a page read in is freed, the mapping is not */
+        if(leaf->row[j].flags & ROW_BORROWED) editorRowMakeWritable(&leaf->row[j]);
     }
-    E.cx=0;
-    E.cy++;
+    if(leaf->page) editorPageDrop(leaf);
+    leaf->off=-1;
 }
-void editorDelChar(){/* is actually backspace,and delete is based on backspace*/
-    if(E.cy==E.numrows) return;
-    if(E.cx==0 && E.cy==0) return;
-    erow *row=&E.row[E.cy];
-    if(E.cx>0){
-        editorRowDelChar(row,E.cx-1);
-        E.cx--;
-    }else{
-        E.cx=E.row[E.cy-1].size;
-        editorRowAppendString(&E.row[E.cy-1],row->chars,row->size);
-        editorDelRow(E.cy);
-        E.cy--;
+void* editorIndexWalk(void* arg){
+    /* the loader thread with -m: reads the file a block at a time and cuts it into pages,
+    the first ones are handed over early so the first paint needn't wait for a whole batch */
+    (void)arg;
+    char* buf=malloc(KILO_PAGE_READ+32);
+    ropeNode* batch[KILO_LOAD_BATCH];
+    int n=0;
+    ropeNode* leaf=NULL;
+    long long off=0,line=0;/* where the next block starts, and where the line being read does */
+    int first=1;
+    while(off<E.load_size){
+        long long want=E.load_size-off;
+        ssize_t r=pread(E.page_fd,buf,want<KILO_PAGE_READ ? want : KILO_PAGE_READ,off);
+        if(r==-1 && errno==EINTR) continue;
+        if(r<=0) break;/* the file got shorter, what was read is all there is */
+        memset(&buf[r],0,32);/* the last window finds no newlines past the end */
+        unsigned int mask=0;
+        int at=-32;
+        while(1){
+            while(mask==0 && (at+=32)<r) mask=editorNewlines(&buf[at]);
+            if(mask==0) break;
+            int j=at+__builtin_ctz(mask);
+            mask&=mask-1;
+            if(!leaf) leaf=editorPageNew(line);
+            leaf->n++;
+            line=off+j+1;
+            if(leaf->n<ROPE_LEAF_ROWS) continue;
+            leaf->len=line-leaf->off;
+            leaf->count=leaf->n;
+            batch[n++]=leaf;
+            leaf=NULL;
+            if(n==KILO_LOAD_BATCH || (first && line>=KILO_LOAD_FIRST)){
+                editorLoadHandOver(batch,n,line);
+                first=0;
+                n=0;
+            }
+        }
+        off+=r;
+    }
+    if(line<off){/* the last line has no newline */
+        if(!leaf) leaf=editorPageNew(line);
+        leaf->n++;
     }
+    if(leaf){
+        leaf->len=off-leaf->off;
+        leaf->count=leaf->n;
+        batch[n++]=leaf;
+    }
+    if(n>0) editorLoadHandOver(batch,n,off);
+    free(buf);
+    editorLoadDone();
+    return NULL;
 }
-
-/* ***file i/o*** */
-char* editorRowsToString(int* buflen){
-    int totlen=0;
+void editorLoadPoll(){
+    /* the main thread's half: hang whatever leaves are ready onto E.rows. appending rows
+    shifts no index, so the cursor, the search and the highlight checkpoints stay good */
+    if(!E.loading) return;
+    char buf[64];
+    if(read(E.load_pipe[0],buf,sizeof(buf))==-1){}/* non-blocking, just drains the wake-ups */
+    pthread_mutex_lock(&E.load_mutex);
+    ropeNode** ready=E.load_ready;
+    int n=E.load_nready;
+    E.load_ready=NULL;
+    E.load_nready=E.load_readycap=0;
+    E.load_bytes=E.load_pos;
+    int done=E.load_done;
+    pthread_mutex_unlock(&E.load_mutex);
     int j;
-    for(j=0;j<E.numrows;j++){
-        totlen+=E.row[j].size+1;
+    for(j=0;j<n;j++){
+        E.numrows+=ready[j]->count;
+        ropeAppend(ready[j]);
     }
-    *buflen=totlen;
-    
-    char* buf=malloc(totlen);
-    char* p=buf;
-    for(j=0;j<E.numrows;j++){
-        memcpy(p,E.row[j].chars,E.row[j].size);
-        p+=E.row[j].size;
-        *p='\n';
-        p++;
+    free(ready);
+    if(done){
+        pthread_join(E.load_thread,NULL);
+        E.loading=0;
+        E.load_scan=1;/* not now, this may be in the middle of an edit */
+    }
+}
+void editorLoadScan(){
+    /* the comment state scan only covered the rows there were when it ran, the tail came in
+    after it. a tail that long gets the threads too, not a row at a time later. between keys */
+    if(!E.load_scan) return;
+    E.load_scan=0;
+    editorSyntaxParallel(E.numrows);
+}
+void editorLoadWait(){/* block until the loader has more, and take it */
+    struct pollfd pfd={E.load_pipe[0],POLLIN,0};
+    if(poll(&pfd,1,-1)==-1 && errno!=EINTR) die("poll");
+    editorLoadPoll();
+}
+void editorLoadFinish(){/* wait for the rest of the file */
+    while(E.loading) editorLoadWait();
+}
+char* editorAppendPage(char* p,char* end){/* a page of the mapping for the lines at p, after the last row */
+    ropeNode* leaf;
+    char* next=editorMapPage(p,end,&leaf);
+    E.numrows+=leaf->n;
+    ropeAppend(leaf);
+    return next;
+}
+char* editorAppendRows(char* p,char* end,int last){/* a leaf of rows for the lines at p, after the last row */
+    ropeNode* leaf=ropeNewNode(1);
+    char* next=editorSplitRows(leaf,p,end,last);
+    if(leaf->n==0){
+        ropeFreeNode(leaf);
+        return next;
+    }
+    leaf->count=leaf->n;
+    E.numrows+=leaf->n;
+    ropeAppend(leaf);
+    return next;
+}
+void editorLoadMap(){
+    /* the first screenfuls are cut into pages right away so they can be drawn, a thread
+    goes on with the rest. how long the first paint takes doesn't depend on the file size */
+    char* p=E.map;
+    char* end=E.map+E.maplen;
+    char* first=E.maplen>KILO_LOAD_FIRST ? E.map+KILO_LOAD_FIRST : end;
+    while(p<first) p=editorAppendPage(p,end);
+    E.load_bytes=p-E.map;
+    if(p==end) return;
+    E.load_pos=E.load_bytes;
+    E.load_done=0;
+    if(pthread_create(&E.load_thread,NULL,editorLoadWalk,p)!=0){
+        while(p<end) p=editorAppendPage(p,end);
+        E.load_bytes=E.maplen;
+        return;
+    }
+    E.loading=1;
+}
+void editorLoadStream(int fd){
+    /* pipes, empty files and whatever else mmap() refuses are read in big blocks, and the
+    rows borrow from the blocks as they would from a mapping. a line cut off at the end of
+    a block is carried over to the start of the next one */
+    char* carry=NULL;
+    size_t have=0;
+    char* prev=NULL;/* the last block, if no row borrows from it */
+    while(1){
+        size_t cap=have*2>KILO_READ_BLOCK ? have*2 : KILO_READ_BLOCK;
+        char* block;
+        if(posix_memalign((void**)&block,4096,cap)!=0) die("posix_memalign");
+        if(have>0) memcpy(block,carry,have);
+        free(prev);
+        size_t len=have;
+        int eof=0;
+        while(len<cap && !eof){
+            ssize_t r=read(fd,block+len,cap-len);
+            if(r==-1 && errno==EINTR) continue;
+            if(r==-1) die("read");
+            if(r==0) eof=1;
+            len+=r>0 ? r : 0;
+        }
+        char* p=block;
+        char* end=block+len;
+        while(p<end){
+            char* next=editorAppendRows(p,end,eof);
+            if(next==p) break;/* just the start of a line is left */
+            p=next;
+        }
+        if(eof){
+            if(p==block) free(block);
+            break;
+        }
+        carry=p;
+        have=end-p;
+        prev=(p==block) ? block : NULL;
     }
-    return buf;
+    close(fd);
 }
 void editorOpen(char* filename){
     free(E.filename);
@@ -592,23 +2589,108 @@ void editorOpen(char* filename){
 
     editorSelectSyntaxHighlight();
 
-    FILE* fp=fopen(filename,"r");
-    if(!fp) die("fopen");
-
-    char* line=NULL;
-    size_t linecap=0;/* line capacity.getline set the value to tell you how many bytes it allocated */
-    ssize_t linelen;
-    while((linelen=getline(&line,&linecap,fp))!=-1){
-        while(linelen>0 && (line[linelen-1]=='\r' || line[linelen-1]=='\n'))/* truncate the terminal \r and \n  */
-            linelen--;                                              /* because we will add them in editorDrawRows()*/
-        editorInsertRow(E.numrows,line,linelen);
+    int fd=open(filename,O_RDONLY);
+    if(fd==-1) die("open");
+    struct stat st;
+    if(E.page_limit>0 && fstat(fd,&st)==0 && S_ISREG(st.st_mode) && st.st_size>0){
+        E.paging=1;
+        E.page_fd=fd;/* kept open: pages are read from it, even once a save has replaced the file */
+        E.load_size=st.st_size;
+        E.load_pos=0;
+        E.load_done=0;
+        if(pthread_create(&E.load_thread,NULL,editorIndexWalk,NULL)!=0) die("pthread_create");
+        E.loading=1;
+        while(E.loading && E.numrows==0) editorLoadWait();/* just the first pages before the first paint */
+        E.dirty=0;
+        return;
+    }
+    if(fstat(fd,&st)==0 && S_ISREG(st.st_mode) && st.st_size>0){
+        char* map=mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+        if(map!=MAP_FAILED){
+            close(fd);/* the mapping stays valid after the descriptor is closed */
+            E.map=map;
+            E.maplen=st.st_size;
+            E.load_size=st.st_size;
+            editorLoadMap();
+            E.dirty=0;
+            return;
+        }
     }
-    free(line);/* get line allocate a piece of memeory,and set `line` to point to it */
-    fclose(fp);
 
+    editorLoadStream(fd);
     E.dirty=0;
 }
+void* editorSaveWalk(void* arg){
+    /* the save thread: reads only E.save_rows, which the main thread leaves alone */
+    (void)arg;
+    E.save_t0=editorNsNow();
+    long long len=editorWriteRows(E.save_fd,E.save_rows);
+    int err=0;
+    if(len!=-1 && fsync(E.save_fd)==-1) len=-1;
+    if(len==-1) err=errno;
+    if(close(E.save_fd)==-1 && len!=-1){
+        err=errno;
+        len=-1;
+    }
+    if(len!=-1 && rename(E.save_tmp,E.save_path)==-1){
+        err=errno;
+        len=-1;
+    }
+    if(len==-1){
+        unlink(E.save_tmp);
+    }else{
+        /* make the rename itself durable too */
+        char* slash=strrchr(E.save_path,'/');
+        if(slash) *slash='\0';
+        int dir=open(slash ? (slash==E.save_path ? "/" : E.save_path) : ".",O_RDONLY);
+        if(dir!=-1){
+            fsync(dir);
+            close(dir);
+        }
+    }
+    E.save_len=len;
+    E.save_err=err;
+    E.save_ms=editorMsNow()-E.save_start;
+    E.save_rss1=editorRssKb();
+    E.save_t1=editorNsNow();
+    if(write(E.save_pipe[1],"",1)==-1){}/* wakes up editorInputWait(), it can't fail short of a bug */
+    return NULL;
+}
+void editorSaveDone(){
+    /* the main thread's half of the end of a save: waits for the thread if it isn't done
+    yet, lets go of the snapshot and of the chars nothing needs anymore, and reports */
+    if(!E.saving) return;
+    pthread_join(E.save_thread,NULL);
+    char c;
+    if(read(E.save_pipe[0],&c,1)==-1){}
+    E.saving=0;
+    editorProfEvent(PROF_SAVE_THREAD,E.save_t0,E.save_t1-E.save_t0,2);
+    ropeRelease(E.save_rows);
+    E.save_rows=NULL;
+    int j;
+    for(j=0;j<E.save_ngarbage;j++) free(E.save_garbage[j]);
+    E.save_ngarbage=0;
+    free(E.save_path);
+    free(E.save_tmp);
+    if(E.save_len==-1){
+        editorSetStatusMessage("Can't save! I/O error:%s",strerror(E.save_err));
+        return;
+    }
+    E.dirty-=E.save_dirty;/* edits made during the save are still unsaved */
+    /* what the save itself cost is the change in resident memory over it. ru_maxrss is the
+    high-water mark of the whole process, a big load shows up there long after */
+    struct rusage ru;
+    getrusage(RUSAGE_SELF,&ru);
+    long drss=(E.save_rss0<0 || E.save_rss1<0) ? 0 : (E.save_rss1-E.save_rss0)/1024;
+    editorSetStatusMessage("%lld bytes in %lldms (%.0f MB/s), RSS %+ldMB, process peak %ldMB",
+        E.save_len,E.save_ms,E.save_len/1048576.0*1000/(E.save_ms>0 ? E.save_ms : 1),drss,ru.ru_maxrss/1024);
+}
 void editorSave(){
+    if(E.saving){
+        editorSetStatusMessage("Still saving, try again when it is done");
+        return;
+    }
+    editorLoadFinish();/* a save writes the whole file */
     if(E.filename==NULL){
         E.filename=editorPrompt("Save as: %s (ESC to cancel)",NULL);
         if(E.filename==NULL){
@@ -618,95 +2700,753 @@ void editorSave(){
         editorSelectSyntaxHighlight();
     }
 
-    int len;
-    char* buf=editorRowsToString(&len);
-    /* fd:filedescriptor */
-    int fd=open(E.filename,O_RDWR | O_CREAT,0644);
-    /* create a new file if it doesn’t already exist (O_CREAT), and open it for reading and writing (O_RDWR).
-    Because we used the O_CREAT flag, we have to pass an extra argument containing the mode (the permissions):
-    0644 is the standard permissions you usually want for text files. 
-    It gives the owner of the file permission to read and write the file, 
-    and everyone else only gets permission to read the file.  */
-
-    if(fd!=-1){
-        if(ftruncate(fd,len)!=-1){
-            if(write(fd,buf,len)==len){
-                close(fd);
-                free(buf);
-                E.dirty=0;
-                editorSetStatusMessage("%d bytes written to disk",len);
-                return;
-            };
-        }
-        close(fd);
+    /* the rows are written to a new file next to the old one, which is only replaced by
+    rename() once the new one is safely on disk: a crash leaves one or the other, whole.
+    the old file stays intact while we write, so rows borrowed from its mapping can be
+    written out from there. the writing happens on a thread of its own, from a snapshot
+    of the row tree, so editing goes on meanwhile */
+    char* path=realpath(E.filename,NULL);/* through a symlink, to the file it points to */
+    if(!path) path=strdup(E.filename);
+    char* tmp=malloc(strlen(path)+16);
+    sprintf(tmp,"%s.kilo-XXXXXX",path);
+    int fd=mkstemp(tmp);
+    if(fd==-1){
+        editorSetStatusMessage("Can't save! I/O error:%s",strerror(errno));
+        free(path);
+        free(tmp);
+        return;
     }
-    free(buf);
-    editorSetStatusMessage("Can't save! I/O error:%s",strerror(errno));
+    struct stat st;
+    if(stat(path,&st)==0){/* keep the old file's permissions and owner */
+        fchmod(fd,st.st_mode & 07777);
+        if(fchown(fd,st.st_uid,st.st_gid)==-1){}/* only root may give files away, fine */
+    }else{
+        mode_t mask=umask(0);
+        umask(mask);
+        fchmod(fd,0644 & ~mask);/* 0644: the owner reads and writes, everyone else reads */
+    }
+
+    editorCloseGap();/* the snapshot needs every row in one piece */
+    E.save_rows=E.rows;
+    E.save_rows->ref++;
+    E.save_path=path;
+    E.save_tmp=tmp;
+    E.save_fd=fd;
+    E.save_dirty=E.dirty;
+    E.save_start=editorMsNow();
+    E.save_rss0=editorRssKb();
+    E.saving=1;
+    if(pthread_create(&E.save_thread,NULL,editorSaveWalk,NULL)!=0){
+        editorSaveWalk(NULL);/* no thread to be had, write it here */
+    }
+    editorSetStatusMessage("Saving...");
+}
 
+/* ***regex*** */
+/* search patterns are compiled to an NFA (Thompson's construction) and matched with a DFA
+that is built lazily, a state at a time as the text asks for it. matching is linear in the
+text and never backtracks. supported: literals, . [] [^] \d \w \s (and \D \W \S),
+^ $ * + ? | and ( ) */
+#define RE_SET 0    /* takes one byte out of set */
+#define RE_EPS 1
+#define RE_SPLIT 2
+#define RE_BOL 3
+#define RE_EOL 4
+#define RE_MATCH 5
+#define KILO_RE_STATES 512  /* DFA states a matcher caches, then the cache starts over */
+
+typedef struct reNode{
+    int type;
+    int out,out1;
+    unsigned char set[32];/* RE_SET only, bit c is byte c */
+}reNode;
+typedef struct regex{
+    reNode* node;
+    int n,cap;
+    int start;
+    char lit[64];/* chars every match contains in a row, rows without them are skipped */
+    int litlen;
+    unsigned char first[32];/* bytes a match can start with */
+    char* p;/* where the parser is */
+    int depth;/* of ( */
+    int alt;/* a | outside any ( ), so there is no one literal every match needs */
+}regex;
+typedef struct reFrag{
+    int start;
+    int end;/* an RE_EPS whose out is still to be filled in, start is -1 on a syntax error */
+}reFrag;
+
+int reNewNode(regex* re,int type,int out,int out1){
+    if(re->n==re->cap){
+        re->cap=re->cap ? re->cap*2 : 32;
+        re->node=realloc(re->node,re->cap*sizeof(reNode));
+    }
+    reNode* node=&re->node[re->n];
+    node->type=type;
+    node->out=out;
+    node->out1=out1;
+    memset(node->set,0,sizeof(node->set));
+    return re->n++;
+}
+reFrag reOne(regex* re,int type){/* a single node followed by the loose end */
+    reFrag f;
+    f.end=reNewNode(re,RE_EPS,-1,-1);
+    f.start=reNewNode(re,type,f.end,-1);
+    return f;
+}
+void reSetAdd(unsigned char* set,int from,int to){
+    int c;
+    for(c=from;c<=to;c++) set[c>>3]|=1<<(c&7);
+}
+int reClassEscape(unsigned char* set,int c){
+    /* \d \w \s and their negations, 0 if c isn't one of them */
+    unsigned char tmp[32];
+    memset(tmp,0,sizeof(tmp));
+    switch(tolower(c)){
+    case 'd': reSetAdd(tmp,'0','9'); break;
+    case 'w': reSetAdd(tmp,'0','9'); reSetAdd(tmp,'a','z'); reSetAdd(tmp,'A','Z'); reSetAdd(tmp,'_','_'); break;
+    case 's': reSetAdd(tmp,' ',' '); reSetAdd(tmp,'\t','\r'); break;
+    default: return 0;
+    }
+    int j;
+    for(j=0;j<32;j++) set[j]|=isupper(c) ? ~tmp[j] : tmp[j];
+    return 1;
+}
+int reEscapeChar(int c){
+    if(c=='t') return '\t';
+    if(c=='n') return '\n';
+    if(c=='r') return '\r';
+    return c;
+}
+reFrag reParseAlt(regex* re);
+reFrag reParseAtom(regex* re,int* lit){
+    /* one char, class, group or anchor. *lit is the char when it is a plain one */
+    reFrag f={-1,-1};
+    *lit=-1;
+    int c=(unsigned char)*re->p;
+    if(c=='\0' || c=='*' || c=='+' || c=='?' || c==')' || c=='|') return f;
+    re->p++;
+    if(c=='('){
+        re->depth++;
+        f=reParseAlt(re);
+        re->depth--;
+        if(f.start==-1 || *re->p!=')'){
+            f.start=-1;
+            return f;
+        }
+        re->p++;
+        return f;
+    }
+    if(c=='^') return reOne(re,RE_BOL);
+    if(c=='$') return reOne(re,RE_EOL);
+
+    f=reOne(re,RE_SET);
+    unsigned char* set=re->node[f.start].set;
+    if(c=='.'){
+        reSetAdd(set,0,255);
+    }else if(c=='\\'){
+        c=(unsigned char)*re->p;
+        if(c=='\0'){
+            f.start=-1;
+            return f;
+        }
+        re->p++;
+        if(!reClassEscape(set,c)){
+            *lit=reEscapeChar(c);
+            reSetAdd(set,*lit,*lit);
+        }
+    }else if(c=='['){
+        int neg=(*re->p=='^');
+        if(neg) re->p++;
+        int first=1;
+        while(*re->p!=']' || first){
+            first=0;
+            int a=(unsigned char)*re->p++;
+            if(a=='\0'){
+                f.start=-1;
+                return f;
+            }
+            if(a=='\\'){
+                a=(unsigned char)*re->p++;
+                if(a=='\0'){
+                    f.start=-1;
+                    return f;
+                }
+                if(reClassEscape(set,a)) continue;
+                a=reEscapeChar(a);
+            }
+            int b=a;
+            if(re->p[0]=='-' && re->p[1]!=']' && re->p[1]!='\0'){
+                b=(unsigned char)re->p[1];
+                re->p+=2;
+                if(b=='\\' && *re->p) b=reEscapeChar((unsigned char)*re->p++);
+                if(b<a){
+                    f.start=-1;
+                    return f;
+                }
+            }
+            reSetAdd(set,a,b);
+        }
+        re->p++;
+        if(neg){
+            int j;
+            for(j=0;j<32;j++) set[j]=~set[j];
+        }
+    }else{
+        *lit=c;
+        reSetAdd(set,c,c);
+    }
+    return f;
+}
+reFrag reParseRepeat(regex* re,int* lit){
+    reFrag f=reParseAtom(re,lit);
+    if(f.start==-1) return f;
+    while(*re->p=='*' || *re->p=='+' || *re->p=='?'){
+        char q=*re->p++;
+        *lit=-1;
+        int end=reNewNode(re,RE_EPS,-1,-1);
+        int split=reNewNode(re,RE_SPLIT,f.start,end);
+        re->node[f.end].out=(q=='?') ? end : split;
+        f.start=(q=='+') ? f.start : split;
+        f.end=end;
+    }
+    return f;
+}
+reFrag reParseConcat(regex* re){
+    reFrag f={-1,-1};
+    char run[64];/* plain chars in a row at the top level, the longest one is the prefilter */
+    int runlen=0;
+    while(*re->p && *re->p!='|' && *re->p!=')'){
+        int lit;
+        reFrag g=reParseRepeat(re,&lit);
+        if(g.start==-1) return g;
+        if(f.start==-1){
+            f=g;
+        }else{
+            re->node[f.end].out=g.start;
+            f.end=g.end;
+        }
+        if(re->depth>0) continue;
+        if(lit!=-1 && runlen<(int)sizeof(run)) run[runlen++]=lit;
+        else runlen=0;
+        if(runlen>re->litlen){
+            memcpy(re->lit,run,runlen);
+            re->litlen=runlen;
+        }
+    }
+    if(f.start==-1) f=reOne(re,RE_EPS);/* empty, matches nothing in particular */
+    return f;
+}
+reFrag reParseAlt(regex* re){
+    reFrag f=reParseConcat(re);
+    while(f.start!=-1 && *re->p=='|'){
+        re->p++;
+        if(re->depth==0) re->alt=1;
+        reFrag g=reParseConcat(re);
+        if(g.start==-1) return g;
+        int end=reNewNode(re,RE_EPS,-1,-1);
+        re->node[f.end].out=end;
+        re->node[g.end].out=end;
+        f.start=reNewNode(re,RE_SPLIT,f.start,g.start);
+        f.end=end;
+    }
+    return f;
+}
+void reFirst(regex* re){
+    /* the bytes of every RE_SET reachable from the start without taking a byte. no other
+    byte can begin a match that isn't empty, so match starts need only be tried there */
+    int* stack=malloc(re->n*sizeof(int));
+    char* seen=calloc(re->n,1);
+    int sp=0,j;
+    memset(re->first,0,sizeof(re->first));
+    stack[sp++]=re->start;
+    seen[re->start]=1;
+    while(sp){
+        reNode* nd=&re->node[stack[--sp]];
+        int next[2]={-1,-1};
+        if(nd->type==RE_SET){
+            for(j=0;j<32;j++) re->first[j]|=nd->set[j];
+        }else if(nd->type!=RE_MATCH && nd->type!=RE_EOL){/* past $ only an empty match is left */
+            next[0]=nd->out;
+            if(nd->type==RE_SPLIT) next[1]=nd->out1;
+        }
+        for(j=0;j<2;j++){
+            if(next[j]!=-1 && !seen[next[j]]){
+                seen[next[j]]=1;
+                stack[sp++]=next[j];
+            }
+        }
+    }
+    free(stack);
+    free(seen);
+}
+regex* reCompile(char* pattern){/* NULL if the pattern is not well formed */
+    regex* re=malloc(sizeof(regex));
+    re->node=NULL;
+    re->n=re->cap=0;
+    re->litlen=0;
+    re->p=pattern;
+    re->depth=0;
+    re->alt=0;
+    reFrag f=reParseAlt(re);
+    if(f.start==-1 || *re->p!='\0'){/* a syntax error, or a ) too many */
+        free(re->node);
+        free(re);
+        return NULL;
+    }
+    int match=reNewNode(re,RE_MATCH,-1,-1);/* may move re->node */
+    re->node[f.end].out=match;
+    re->start=f.start;
+    if(re->alt) re->litlen=0;
+    reFirst(re);
+    return re;
+}
+void reFree(regex* re){
+    if(!re) return;
+    free(re->node);
+    free(re);
+}
 
-    /* ftruncate() sets the file’s size to the specified length. 
-    If the file is larger than that, it will cut off any data at the end of the file to make it that length. 
-    If the file is shorter, it will add 0 bytes at the end to make it that length. */
+typedef struct reDState{
+    int* set;/* the NFA nodes this state stands for, sorted */
+    int nset;
+    int accept;/* 1: a match ends here, 2: a match ends here if the row ends here too */
+    int next[256];/* -1 until that transition is first needed */
+}reDState;
+typedef struct reDFA{
+    /* one per thread: it changes as it matches */
+    regex* re;
+    int unanchored;/* a match may start anywhere, not just where matching started */
+    reDState* st;
+    int n;
+    int hash[2*KILO_RE_STATES];/* open addressing over st, -1 for empty */
+    int start0,start;/* the start state at column 0 (where ^ holds) and elsewhere, -1 if not built */
+    int* set;/* scratch for a state being built */
+    int nset;
+    int* mark;/* mark[node]==gen once it is in set */
+    int gen;
+    int* stack;
+}reDFA;
+
+void reDFAInit(reDFA* d,regex* re,int unanchored){
+    d->re=re;
+    d->unanchored=unanchored;
+    d->st=malloc(KILO_RE_STATES*sizeof(reDState));
+    d->n=0;
+    memset(d->hash,-1,sizeof(d->hash));
+    d->start0=d->start=-1;
+    d->set=malloc(re->n*sizeof(int));
+    d->mark=calloc(re->n,sizeof(int));
+    d->gen=0;
+    d->stack=malloc(2*re->n*sizeof(int)+sizeof(int));
+}
+void reDFAFree(reDFA* d){
+    int j;
+    for(j=0;j<d->n;j++) free(d->st[j].set);
+    free(d->st);
+    free(d->set);
+    free(d->mark);
+    free(d->stack);
+}
+void reClosure(reDFA* d,int node,int atstart,int atend){
+    /* add node and all it reaches without taking a byte to d->set. ^ is passed only
+    at column 0 and $ only at the end of the row, else $ stays in the set to be tried there */
+    int sp=0;
+    d->stack[sp++]=node;
+    while(sp){
+        int x=d->stack[--sp];
+        if(x<0 || d->mark[x]==d->gen) continue;
+        d->mark[x]=d->gen;
+        reNode* nd=&d->re->node[x];
+        switch(nd->type){
+        case RE_EPS: d->stack[sp++]=nd->out; break;
+        case RE_SPLIT: d->stack[sp++]=nd->out; d->stack[sp++]=nd->out1; break;
+        case RE_BOL: if(atstart) d->stack[sp++]=nd->out; break;
+        case RE_EOL:
+            if(atend) d->stack[sp++]=nd->out;
+            else d->set[d->nset++]=x;
+            break;
+        default: d->set[d->nset++]=x; break;/* RE_SET and RE_MATCH */
+        }
+    }
+}
+int reIntCmp(const void* a,const void* b){
+    return *(const int*)a-*(const int*)b;
+}
+int reHasMatch(reDFA* d,int* set,int nset){
+    int j;
+    for(j=0;j<nset;j++) if(d->re->node[set[j]].type==RE_MATCH) return 1;
+    return 0;
+}
+int reState(reDFA* d,int* flushed){
+    /* the state for the nodes in d->set, made if it doesn't exist yet */
+    *flushed=0;
+    qsort(d->set,d->nset,sizeof(int),reIntCmp);
+    unsigned int hash=2166136261u;/* FNV-1a */
+    int j;
+    for(j=0;j<d->nset;j++) hash=(hash^d->set[j])*16777619u;
+    unsigned int mask=2*KILO_RE_STATES-1;
+    unsigned int h;
+    for(h=hash&mask;d->hash[h]!=-1;h=(h+1)&mask){
+        reDState* s=&d->st[d->hash[h]];
+        if(s->nset==d->nset && !memcmp(s->set,d->set,d->nset*sizeof(int))) return d->hash[h];
+    }
+    if(d->n==KILO_RE_STATES){/* full: start over, states get built again as needed */
+        for(j=0;j<d->n;j++) free(d->st[j].set);
+        d->n=0;
+        memset(d->hash,-1,sizeof(d->hash));
+        d->start0=d->start=-1;
+        *flushed=1;
+        h=hash&mask;
+    }
+    int idx=d->n++;
+    reDState* s=&d->st[idx];
+    s->nset=d->nset;
+    s->set=malloc(d->nset*sizeof(int)+1);
+    memcpy(s->set,d->set,d->nset*sizeof(int));
+    memset(s->next,-1,sizeof(s->next));
+    s->accept=reHasMatch(d,s->set,s->nset);
+    if(!s->accept){/* would following the $ nodes reach the end? */
+        d->gen++;
+        d->nset=0;
+        for(j=0;j<s->nset;j++){
+            if(d->re->node[s->set[j]].type==RE_EOL) reClosure(d,d->re->node[s->set[j]].out,0,1);
+        }
+        if(reHasMatch(d,d->set,d->nset)) s->accept=2;
+    }
+    d->hash[h]=idx;
+    return idx;
+}
+int reStart(reDFA* d,int atstart){/* builds the start state, then the matchers keep it in start0/start */
+    int flushed;
+    d->gen++;
+    d->nset=0;
+    reClosure(d,d->re->start,atstart,0);
+    int s=reState(d,&flushed);
+    *(atstart ? &d->start0 : &d->start)=s;
+    return s;
+}
+int reStep(reDFA* d,int s,unsigned char c){/* the slow way, when s has no next[c] yet */
+    d->gen++;
+    d->nset=0;
+    reDState* st=&d->st[s];
+    int j;
+    for(j=0;j<st->nset;j++){
+        reNode* nd=&d->re->node[st->set[j]];
+        if(nd->type==RE_SET && (nd->set[c>>3] & (1<<(c&7)))) reClosure(d,nd->out,0,0);
+    }
+    if(d->unanchored) reClosure(d,d->re->start,0,0);
+    int flushed;
+    int next=reState(d,&flushed);
+    if(!flushed) d->st[s].next[c]=next;/* else s is gone */
+    return next;
+}
+int reSearch(reDFA* d,char* s,int len){/* is there a match anywhere in s? d has to be unanchored */
+    int st=(d->start0!=-1) ? d->start0 : reStart(d,1);
+    int i;
+    for(i=0;i<len;i++){
+        reDState* p=&d->st[st];
+        if(p->accept==1) return 1;
+        st=p->next[(unsigned char)s[i]];
+        if(st==-1) st=reStep(d,p-d->st,s[i]);
+    }
+    return d->st[st].accept!=0;
+}
+int reMatchAt(reDFA* d,char* s,int len,int at){
+    /* length of the longest match starting at s[at], -1 if none. d has to be anchored */
+    int st=(at==0) ? d->start0 : d->start;
+    if(st==-1) st=reStart(d,at==0);
+    int best=-1;
+    int i;
+    for(i=at;;i++){
+        if(d->st[st].accept==1 || (i==len && d->st[st].accept==2)) best=i-at;
+        if(i==len || d->st[st].nset==0) break;
+        int next=d->st[st].next[(unsigned char)s[i]];
+        st=(next!=-1) ? next : reStep(d,st,s[i]);
+    }
+    return best;
 }
 
 /* ***find*** */
-void editorFindCallBack(char* query,int key){
-    static int last_match=-1;
-    static int direction=1;
+char* editorMemmem(char* hay,int hlen,char* needle,int nlen){
+    /* the first place needle occurs in hay. the SIMD loop compares the needle's first and last
+    bytes at 16 or 32 positions at once, and only where both agree are the bytes between checked */
+    if(nlen==0) return hay;
+    if(nlen>hlen) return NULL;
+    if(nlen==1) return memchr(hay,needle[0],hlen);
+    int i=0;
+    int last=hlen-nlen;/* the last possible start */
+#if defined(__AVX2__)
+    const __m256i first32=_mm256_set1_epi8(needle[0]);
+    const __m256i last32=_mm256_set1_epi8(needle[nlen-1]);
+    for(;i+32<=last+1;i+=32){
+        __m256i a=_mm256_loadu_si256((const __m256i*)&hay[i]);
+        __m256i b=_mm256_loadu_si256((const __m256i*)&hay[i+nlen-1]);
+        unsigned int m=_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a,first32),_mm256_cmpeq_epi8(b,last32)));
+        while(m){
+            int j=i+__builtin_ctz(m);
+            if(!memcmp(&hay[j+1],&needle[1],nlen-2)) return &hay[j];
+            m&=m-1;
+        }
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i first16=_mm_set1_epi8(needle[0]);
+    const __m128i last16=_mm_set1_epi8(needle[nlen-1]);
+    for(;i+16<=last+1;i+=16){
+        __m128i a=_mm_loadu_si128((const __m128i*)&hay[i]);
+        __m128i b=_mm_loadu_si128((const __m128i*)&hay[i+nlen-1]);
+        unsigned int m=_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a,first16),_mm_cmpeq_epi8(b,last16)));
+        while(m){
+            int j=i+__builtin_ctz(m);
+            if(!memcmp(&hay[j+1],&needle[1],nlen-2)) return &hay[j];
+            m&=m-1;
+        }
+    }
+#endif
+    while(i<=last){
+        char* p=memchr(&hay[i],needle[0],last+1-i);
+        if(!p) return NULL;
+        if(!memcmp(p+1,&needle[1],nlen-1)) return p;
+        i=p-hay+1;
+    }
+    return NULL;
+}
+typedef struct searchChunk{
+    int from,to;/* rows */
+    char* query;
+    int qlen;
+    struct regex* re;/* or NULL for a plain query */
+    searchMatch* m;/* the matches found, at most KILO_SEARCH_MAX of them */
+    int n,cap;
+    int count;/* all the matches found */
+    int watch;/* this chunk runs on the main thread and looks out for keys typed meanwhile */
+    int* stop;/* shared by the chunks of a search, set once it is given up */
+    pthread_t thread;
+}searchChunk;
+
+void editorSearchChunkAdd(searchChunk* ck,int row,int col,int len){
+    ck->count++;
+    if(ck->n==KILO_SEARCH_MAX) return;
+    if(ck->n==ck->cap){
+        ck->cap=ck->cap ? ck->cap*2 : 256;
+        ck->m=realloc(ck->m,ck->cap*sizeof(searchMatch));
+    }
+    ck->m[ck->n].row=row;
+    ck->m[ck->n].col=col;
+    ck->m[ck->n].len=len;
+    ck->n++;
+}
+void* editorSearchWalk(void* arg){
+    /* find every match in rows from..to. only reads rows, so several can run at once */
+    searchChunk* ck=arg;
+    reDFA find,at;/* each thread builds its own DFA states */
+    if(ck->re){
+        reDFAInit(&find,ck->re,1);
+        reDFAInit(&at,ck->re,0);
+    }
+    int filerow,n,k;
+    erow* rows;
+    for(filerow=ck->from;filerow<ck->to;filerow+=n){
+        /* a key typed meanwhile makes this search moot, the next query needs its own */
+        if(ck->watch && editorInputPending()) __atomic_store_n(ck->stop,1,__ATOMIC_RELAXED);
+        if(__atomic_load_n(ck->stop,__ATOMIC_RELAXED)) break;
+        editorPageTrim();
+        n=editorRowSpan(filerow,&rows);
+        if(n>ck->to-filerow) n=ck->to-filerow;
+        for(k=0;k<n;k++){
+            char* chars=rows[k].chars;
+            int size=rows[k].size;
+            if(!ck->re){
+                char* p=chars;
+                while((p=editorMemmem(p,size-(p-chars),ck->query,ck->qlen))){
+                    editorSearchChunkAdd(ck,filerow+k,p-chars,ck->qlen);
+                    p++;/* overlapping matches too, a longer query may keep only the later one */
+                }
+                continue;
+            }
+            /* a regex: the literal prefilter and one pass of the search DFA throw out most
+            rows, only rows with a match are gone over again to find where each one is */
+            if(ck->re->litlen && !editorMemmem(chars,size,ck->re->lit,ck->re->litlen)) continue;
+            if(!reSearch(&find,chars,size)) continue;
+            unsigned char* first=ck->re->first;
+            int col=0;
+            while(col<size){
+                unsigned char c=chars[col];
+                if(!(first[c>>3] & (1<<(c&7)))){
+                    col++;
+                    continue;
+                }
+                int len=reMatchAt(&at,chars,size,col);
+                if(len>0){/* leftmost longest, and empty matches are of no use here */
+                    editorSearchChunkAdd(ck,filerow+k,col,len);
+                    col+=len;
+                }else{
+                    col++;
+                }
+            }
+        }
+    }
+    if(ck->re){
+        reDFAFree(&find);
+        reDFAFree(&at);
+    }
+    return NULL;
+}
+int editorSearchUpdate(char* query){
+    /* bring the match list up to date for a new query. when it only got longer, its matches
+    are among the old ones, so those are just checked for the added chars. a full scan is
+    given up as soon as another key comes in: 0 then, and there are no matches until the
+    next call */
+    int qlen=strlen(query);
+    int refine=(!E.search_regex && E.query && E.matches_all && qlen>=E.querylen && E.querylen>0 && !memcmp(query,E.query,E.querylen));
+    int oldlen=E.querylen;
+    free(E.query);
+    E.query=strdup(query);
+    E.querylen=qlen;
+    editorCloseGap();/* matches are looked for in chars, every row in one piece */
+
+    if(refine){
+        int i,n=0;
+        int filerow=-1,span=0;
+        erow* rows=NULL;
+        for(i=0;i<E.nmatches;i++){
+            searchMatch m=E.matches[i];
+            if(m.row<filerow || m.row>=filerow+span){
+                filerow=m.row;
+                span=editorRowSpan(filerow,&rows);
+            }
+            erow* row=&rows[m.row-filerow];
+            m.len=qlen;
+            if(m.col+qlen<=row->size && !memcmp(&row->chars[m.col+oldlen],&query[oldlen],qlen-oldlen))
+                E.matches[n++]=m;
+        }
+        E.nmatches=n;
+        E.nfound=n;
+        return 1;
+    }
 
-    static int saved_hl_line;
-    static unsigned char* saved_hl=NULL;
-    if(saved_hl){
-        memcpy(E.row[saved_hl_line].hl,saved_hl,E.row[saved_hl_line].rsize);
-        free(saved_hl);
-        saved_hl=NULL;
+    E.nmatches=0;
+    E.nfound=0;
+    E.matches_all=1;
+    E.search_bad=0;
+    if(qlen==0) return 1;
+    regex* re=NULL;
+    if(E.search_regex){
+        re=reCompile(query);/* once per query, the DFA states are built while matching */
+        if(!re){
+            E.search_bad=1;
+            return 1;
+        }
     }
 
+    /* one chunk of rows per thread on big buffers, then the lists are joined in order */
+    int nthreads=(E.numrows>=KILO_SEARCH_PARALLEL_ROWS) ? editorThreads() : 1;
+    searchChunk ck[KILO_THREADS];
+    int threaded[KILO_THREADS];
+    int stop=0;
+    int i;
+    for(i=0;i<nthreads;i++){
+        ck[i].watch=(i==0);
+        ck[i].stop=&stop;
+        ck[i].from=(long long)E.numrows*i/nthreads;
+        ck[i].to=(long long)E.numrows*(i+1)/nthreads;
+        ck[i].query=query;
+        ck[i].qlen=qlen;
+        ck[i].re=re;
+        ck[i].m=(i==0) ? E.matches : NULL;/* the first chunk fills E.matches itself */
+        ck[i].cap=(i==0) ? E.matchcap : 0;
+        ck[i].n=0;
+        ck[i].count=0;
+        threaded[i]=(i>0 && pthread_create(&ck[i].thread,NULL,editorSearchWalk,&ck[i])==0);
+    }
+    for(i=0;i<nthreads;i++){
+        if(!threaded[i]) editorSearchWalk(&ck[i]);/* the first chunk runs here, meanwhile the others run on their own */
+    }
+    E.matches=ck[0].m;
+    E.matchcap=ck[0].cap;
+    E.nmatches=ck[0].n;
+    E.nfound=ck[0].count;
+    for(i=1;i<nthreads;i++){
+        if(threaded[i]) pthread_join(ck[i].thread,NULL);
+        int n=ck[i].n;
+        if(n>KILO_SEARCH_MAX-E.nmatches) n=KILO_SEARCH_MAX-E.nmatches;
+        if(E.nmatches+n>E.matchcap){
+            E.matchcap=E.nmatches+n;
+            E.matches=realloc(E.matches,E.matchcap*sizeof(searchMatch));
+        }
+        memcpy(&E.matches[E.nmatches],ck[i].m,n*sizeof(searchMatch));
+        E.nmatches+=n;
+        E.nfound+=ck[i].count;
+        free(ck[i].m);
+    }
+    if(E.nfound>E.nmatches) E.matches_all=0;
+    reFree(re);
+    if(stop){/* half a list is no use, and must not be refined later either */
+        E.nmatches=0;
+        E.nfound=0;
+        free(E.query);
+        E.query=NULL;
+        E.querylen=0;
+        return 0;
+    }
+    return 1;
+}
+void editorSearchEnd(){
+    E.nmatches=0;
+    E.nfound=0;
+    E.match=-1;
+    free(E.query);
+    E.query=NULL;
+    E.querylen=0;
+}
+int editorSearchFirst(int filerow){/* index of the first match at or below filerow */
+    int lo=0,hi=E.nmatches;
+    while(lo<hi){
+        int mid=(lo+hi)/2;
+        if(E.matches[mid].row<filerow) lo=mid+1;
+        else hi=mid;
+    }
+    return lo;
+}
+void editorFindCallBack(char* query,int key){
+    static int stale=0;/* the query changed but the matches were not looked for yet */
     if(key=='\r' || key=='\x1b'){
-        last_match=-1;/* search aborted and we need to reset to prepare for the next search */
-        direction=1;
+        stale=0;
+        editorSearchEnd();/* search is over, the matches stop being highlighted */
         return;
+    }
+    int arrow=(key==ARROW_RIGHT || key==ARROW_DOWN || key==ARROW_LEFT || key==ARROW_UP);
+    if(key==CTRL_KEY('r')){
+        E.search_regex=!E.search_regex;
+        free(E.query);/* the old matches were for the other kind of query */
+        E.query=NULL;
+        E.querylen=0;
+    }
+    if(!arrow || stale){
+        if(!arrow && editorInputWait(0)){
+            stale=1;/* more of the query is already typed, scan once for all of it */
+            return;
+        }
+        stale=0;
+        if(!editorSearchUpdate(query)){
+            stale=1;/* another key came in, it scans again for the query as it is then */
+            E.match=-1;
+            return;
+        }
+        E.match=E.nmatches ? 0 : -1;
     }else if(key==ARROW_RIGHT || key==ARROW_DOWN){
-        direction=1;
-    }else if(key==ARROW_LEFT || key==ARROW_UP){
-        direction=-1;
+        if(E.match!=-1) E.match=(E.match+1)%E.nmatches;/* wrap around and continue from the top */
     }else{
-        last_match=-1;/* query changed and we need to reset */
-        direction=1;
+        if(E.match!=-1) E.match=(E.match+E.nmatches-1)%E.nmatches;/* or from the bottom */
     }
+    if(E.match==-1) return;
 
-    if(last_match==-1) direction=1;/* if there isn't a last_match, search from the beginning and search forward */
-    int current=last_match;/* start from last_match and when we enter the for loop, it will point to the next row */
-    int i;
-    for(i=0;i<E.numrows;i++){
-        current+=direction;
-
-        /* wrap around and continue from the top (or bottom) */
-        if(current==-1){
-            current=E.numrows-1;
-        }else if(current==E.numrows){
-            current=0;
-        }
-
-        erow* row=&E.row[current];
-        char* match=strstr(row->render,query);
-        if(match){
-            last_match=current;
-            E.cy=current;
-            E.cx=editorRowRxToCx(row,match-row->render);
-            /* since they are all addresses of strings, this will be the index */
-            /* match will be bigger(in most case) */
-            E.rowoff=E.cy;
-            /* the tutorial use E.numrows and wait for editorScroll() to convert it to E.cy */
-            /* seems not intuitive to me */
-
-            saved_hl_line=current;
-            saved_hl=malloc(row->rsize);
-            memcpy(saved_hl,row->hl,row->rsize);
-            memset(&row->hl[match-row->render],HL_MATCH,strlen(query));
-            break;
-        }
-    }
+    E.cy=E.matches[E.match].row;
+    E.cx=E.matches[E.match].col;
+    E.rowoff=E.cy;
+    /* the tutorial use E.numrows and wait for editorScroll() to convert it to E.cy */
+    /* seems not intuitive to me */
 }
 void editorFind(){
     int saved_cx=E.cx;
@@ -716,7 +3456,7 @@ void editorFind(){
     /* otherwise, when ESC is pressed, the cursor will go to cx=0;cy=0; 
         because match will return the exact address of row->render,(the first row's),because "" will match any string
     */
-    char *query=editorPrompt("Search: %s (ESC to cancel | Arrows to go to next match)",editorFindCallBack);
+    char *query=editorPrompt("Search: %s (ESC to cancel | Arrows to go to next match | Ctrl-R regex)",editorFindCallBack);
     if(query){
         free(query);
     }else{
@@ -731,23 +3471,26 @@ void editorFind(){
 struct abuf{
     char *b;
     int len;
+    int cap;/* the buffer is kept between frames and only ever grows */
 };
-#define ABUF_INIT {NULL,0}
+#define ABUF_INIT {NULL,0,0}
 void abAppend(struct abuf *ab, const char* s,int len){
-    char* new=realloc(ab->b,ab->len+len);
-    if(new==NULL) return;
-    memcpy(&new[ab->len],s,len);
-    ab->b=new;
+    if(ab->len+len>ab->cap){
+        int cap=ab->cap ? ab->cap : 4096;
+        while(cap<ab->len+len) cap*=2;
+        char* new=realloc(ab->b,cap);
+        if(new==NULL) return;
+        ab->b=new;
+        ab->cap=cap;
+    }
+    memcpy(&ab->b[ab->len],s,len);
     ab->len+=len;
 }
-void abFree(struct abuf *ab){
-    free(ab->b);
-}
 
 /* ***output*** */
 void editorScroll(){
     if(E.cy<E.numrows){
-        E.rx=editorRowCxToRx(&E.row[E.cy],E.cx);
+        E.rx=editorRowCxToRx(editorRowAt(E.cy),E.cx);
     }
     if(E.cy<E.rowoff){
         E.rowoff=E.cy;
@@ -762,123 +3505,239 @@ void editorScroll(){
         E.coloff=E.rx-E.screencols+1;
     }
 }
-void editorDrawRows(struct abuf *ab){
+void editorDrawText(screenCell* line,int at,const char* s,int len,int attr){
+    int j;
+    for(j=0;j<len && at+j<E.screencols;j++){
+        line[at+j].c=s[j];
+        line[at+j].attr=attr;
+    }
+}
+void editorDrawRows(){
     int y;
+    int m=E.nmatches ? editorSearchFirst(E.rowoff) : 0;
     for(y=0;y<E.screenrows;y++){
+        screenCell* line=&E.frame[y*E.screencols];
         int filerow=y+E.rowoff;
+        int x;
+        for(x=0;x<E.screencols;x++){
+            line[x].c=' ';
+            line[x].attr=39;
+        }
         if(filerow>=E.numrows){
+            editorDrawText(line,0,"~",1,39);
             if(E.numrows==0 && y==E.screenrows/3){
                 char welcome[80];
                 int welcomelen=snprintf(welcome,sizeof(welcome),"Kilo editor -- version %s",KILO_VERSION);
                 if(welcomelen>E.screencols) welcomelen=E.screencols;
                 int padding=(E.screencols-welcomelen)/2;
-                if(padding){
-                    abAppend(ab,"~",1);
-                    padding--;
-                }
-                while(padding--) abAppend(ab," ",1);
-                abAppend(ab,welcome,welcomelen);
-            }else{
-            abAppend(ab,"~",1);
+                editorDrawText(line,padding,welcome,welcomelen,39);
             }
         }else{
-            int len=E.row[filerow].rsize-E.coloff;
+            editorPrepareRow(filerow);
+            erow* row=editorRowAt(filerow);
+            int len=row->rsize-E.coloff;
             if(len<0) len=0;
             if(len>E.screencols) len=E.screencols;
 
-            char* c=&E.row[filerow].render[E.coloff];
-            unsigned char* hl=&E.row[filerow].hl[E.coloff];
-            int current_color=-1;
+            char* c=&row->render[E.coloff];
+            unsigned char* hl=&row->hl[E.coloff];
             int j;
             for(j=0;j<len;j++){
                 if(iscntrl(c[j])){
-                    char sym=(c[j]<=26) ? '@'+c[j] : '?';//'@'=64,'A'=65
-                    abAppend(ab,"\x1b[7m",4);
-                    abAppend(ab,&sym,1);
-                    abAppend(ab,"\x1b[m",3);//this turns off all text formatting,including colors.so we check corrent_color
-                    if(current_color!=-1){//because we didn't use the strategy that print \x1b before every char 
-                        char buf[16];
-                        int clen=snprintf(buf,sizeof(buf),"\x1b[%dm",current_color);
-                        abAppend(ab,buf,clen);
-                    }
-                }else if(hl[j]==HL_NORMAL){
-                    if(current_color!=-1){
-                        abAppend(ab,"\x1b[39m",5);
-                        current_color=-1;
-                    }
+                    line[j].c=(c[j]<=26) ? '@'+c[j] : '?';//'@'=64,'A'=65
+                    line[j].attr=39|CELL_INVERSE;
                 }else{
-                    int color=editorSyntaxToColor(hl[j]);
-                    if(current_color!=color){
-                        current_color=color;
-                        char buf[16];
-                        int clen=snprintf(buf,sizeof(buf),"\x1b[%dm",color);
-                        abAppend(ab,buf,clen);
-                    }
+                    line[j].c=c[j];
+                    line[j].attr=(hl[j]==HL_NORMAL) ? 39 : editorSyntaxToColor(hl[j]);
                 }
-                abAppend(ab,&c[j],1);
             }
-            abAppend(ab,"\x1b[39m",5);
+            for(;m<E.nmatches && E.matches[m].row==filerow;m++){/* every match on screen stands out */
+                int from=editorRowCxToRx(row,E.matches[m].col)-E.coloff;
+                int to=editorRowCxToRx(row,E.matches[m].col+E.matches[m].len)-E.coloff;
+                if(from<0) from=0;
+                for(j=from;j<to && j<len;j++) line[j].attr=editorSyntaxToColor(HL_MATCH);
+            }
         }
-        abAppend(ab,"\x1b[K",3);
-        abAppend(ab,"\r\n",2);
     }
 }
-void editorDrawStatusBar(struct abuf *ab){
-    abAppend(ab,"\x1b[7m",4);
-    /* The m command (Select Graphic Rendition) causes the text printed 
-    after it to be printed with various possible attributes including bold (1), underscore (4), blink (5), 
-    and inverted colors (7). For example, you could specify all of these attributes using the command <esc>[1;4;5;7m.
-    An argument of 0 clears all attributes, and is the default argument.*/
+void editorDrawStatusBar(){
+    screenCell* line=&E.frame[E.screenrows*E.screencols];
     char status[80],rstatus[80];
     int len=snprintf(status,sizeof(status),"%.20s - %d lines %s",
     E.filename ? E.filename : "[No Name]",E.numrows,
     E.dirty ? "(modified)" :"");
 
-    int rlen=snprintf(rstatus,sizeof(status),"%s | %d/%d",
+    int rlen=0;
+    if(E.prof_overlay && E.prof_nframes){
+        int n=E.prof_nframes<KILO_PROF_FRAMES ? E.prof_nframes : KILO_PROF_FRAMES;
+        long long sum=0;
+        for(int j=0;j<n;j++) sum+=E.prof_frame[j];
+        rlen+=snprintf(&rstatus[rlen],sizeof(rstatus)-rlen,"frame %.2fms avg %.2fms | ",
+            E.prof_frame[(E.prof_nframes-1)%KILO_PROF_FRAMES]/1e6,sum/n/1e6);
+    }
+    if(E.show_frame_bytes) rlen+=snprintf(&rstatus[rlen],sizeof(rstatus)-rlen,"%dB | ",E.frame_bytes);
+    if(E.match!=-1){
+        rlen+=snprintf(&rstatus[rlen],sizeof(rstatus)-rlen,"match %d of %d | ",E.match+1,E.nfound);
+    }else if(E.search_bad){
+        rlen+=snprintf(&rstatus[rlen],sizeof(rstatus)-rlen,"bad regex | ");
+    }else if(E.querylen){
+        rlen+=snprintf(&rstatus[rlen],sizeof(rstatus)-rlen,"no matches | ");
+    }
+    if(E.query && E.search_regex) rlen+=snprintf(&rstatus[rlen],sizeof(rstatus)-rlen,"regex | ");
+    if(E.loading) rlen+=snprintf(&rstatus[rlen],sizeof(rstatus)-rlen,"loading %d%% | ",(int)(E.load_bytes*100/E.load_size));
+    rlen+=snprintf(&rstatus[rlen],sizeof(rstatus)-rlen,"%s | %d/%d",
     E.syntax ? E.syntax->filetype : "no ft",E.cy+1,E.numrows);
+    if(rlen>(int)sizeof(rstatus)-1) rlen=sizeof(rstatus)-1;
 
     if(len>E.screencols) len=E.screencols;
-    abAppend(ab,status,len);
-    while(len<E.screencols){
-        if(E.screencols-len==rlen){
-            abAppend(ab,rstatus,rlen);
-            break;
-        }else{
-            abAppend(ab," ",1);
-            len++;
-        }
+    int x;
+    for(x=0;x<E.screencols;x++){
+        line[x].c=' ';
+        line[x].attr=39|CELL_INVERSE;/* the whole bar is in inverted colors */
     }
-    abAppend(ab,"\x1b[m",3);
-    abAppend(ab,"\r\n",2);/* go to next row: message bar */
+    editorDrawText(line,0,status,len,39|CELL_INVERSE);
+    if(E.screencols-len>=rlen) editorDrawText(line,E.screencols-rlen,rstatus,rlen,39|CELL_INVERSE);
 }
-void editorDrawMessageBar(struct abuf *ab){
-    abAppend(ab,"\x1b[K",3);
+void editorDrawMessageBar(){
+    screenCell* line=&E.frame[(E.screenrows+1)*E.screencols];
+    int x;
+    for(x=0;x<E.screencols;x++){
+        line[x].c=' ';
+        line[x].attr=39;
+    }
     int msglen=strlen(E.statusmsg);
     if(msglen>E.screencols) msglen=E.screencols;
     if(msglen && time(NULL)-E.statusmsg_time<4)
-        abAppend(ab,E.statusmsg,msglen);
+        editorDrawText(line,0,E.statusmsg,msglen,39);
+}
+const char* SGR_COLOR[]={/* SGR_COLOR[c-30] sets foreground color c, all of them 5 bytes */
+    "\x1b[30m","\x1b[31m","\x1b[32m","\x1b[33m","\x1b[34m",
+    "\x1b[35m","\x1b[36m","\x1b[37m","\x1b[38m","\x1b[39m"
+};
+void editorSetAttr(struct abuf* ab,int* cur,int attr){
+    if(*cur==attr) return;
+    if((*cur & CELL_INVERSE) && !(attr & CELL_INVERSE)){
+        abAppend(ab,"\x1b[m",3);/* turns off all the attributes, colors too */
+        *cur=39;
+    }
+    if(!(*cur & CELL_INVERSE) && (attr & CELL_INVERSE)) abAppend(ab,"\x1b[7m",4);
+    /* The m command (Select Graphic Rendition) causes the text printed 
+    after it to be printed with various possible attributes including bold (1), underscore (4), blink (5), 
+    and inverted colors (7). An argument of 0 clears all attributes, and is the default argument.*/
+    if((*cur & ~CELL_INVERSE)!=(attr & ~CELL_INVERSE)) abAppend(ab,SGR_COLOR[(attr & ~CELL_INVERSE)-30],5);
+    *cur=attr;
+}
+int editorCellSame(screenCell* a,screenCell* b){
+    return a->c==b->c && a->attr==b->attr;
+}
+void editorFlushLine(struct abuf* ab,int y,int* cur){
+    /* send only the parts of line y that differ from the shadow. runs of changes closer
+    together than a cursor move costs are sent as one, and a blank tail is cleared with K */
+    screenCell* line=&E.frame[y*E.screencols];
+    screenCell* old=&E.shadow[y*E.screencols];
+    if(!memcmp(line,old,E.screencols*sizeof(screenCell))) return;
+    int len=E.screencols;
+    while(len>0 && line[len-1].c==' ' && line[len-1].attr==39) len--;
+
+    int x=0;
+    while(x<E.screencols){
+        if(editorCellSame(&line[x],&old[x])){
+            x++;
+            continue;
+        }
+        int end=x+1,same=0;
+        while(end<E.screencols && same<8){
+            same=editorCellSame(&line[end],&old[end]) ? same+1 : 0;
+            end++;
+        }
+        end-=same;
+
+        char buf[32];
+        int blen=snprintf(buf,sizeof(buf),"\x1b[%d;%dH",y+1,x+1);
+        abAppend(ab,buf,blen);
+        int j=x;
+        char run[256];/* cells of one color, sent as one span */
+        while(j<end && j<len){
+            int attr=line[j].attr;
+            int n=0;
+            while(j<end && j<len && line[j].attr==attr && n<(int)sizeof(run)) run[n++]=line[j++].c;
+            editorSetAttr(ab,cur,attr);
+            abAppend(ab,run,n);
+        }
+        if(end>len){/* the rest of the line is blank */
+            editorSetAttr(ab,cur,39);
+            abAppend(ab,"\x1b[K",3);
+            break;
+        }
+        x=end;
+    }
+}
+void editorScrollShadow(struct abuf* ab,int delta){
+    /* the text moved up (delta>0) or down by delta rows: have the terminal scroll the text
+    area by as much, between the top and the status bar, and do the same to the shadow so
+    only the rows that scrolled into view show up as changed */
+    char buf[48];
+    int n=delta>0 ? delta : -delta;
+    int blen=snprintf(buf,sizeof(buf),"\x1b[1;%dr\x1b[%d%c\x1b[r",E.screenrows,n,delta>0 ? 'S' : 'T');
+    /* DECSTBM (r) sets the scroll region, S and T scroll it up and down, r alone resets it */
+    abAppend(ab,buf,blen);
+
+    int W=E.screencols;
+    screenCell* gone;/* the rows the terminal blanked */
+    if(delta>0){
+        memmove(E.shadow,&E.shadow[n*W],(E.screenrows-n)*W*sizeof(screenCell));
+        gone=&E.shadow[(E.screenrows-n)*W];
+    }else{
+        memmove(&E.shadow[n*W],E.shadow,(E.screenrows-n)*W*sizeof(screenCell));
+        gone=E.shadow;
+    }
+    int j;
+    for(j=0;j<n*W;j++){
+        gone[j].c=' ';
+        gone[j].attr=39;
+    }
 }
 void editorRefreshScreen(){
+    static struct abuf ab=ABUF_INIT;/* reused by every frame, so a refresh allocates nothing */
+    long long t=editorProfNow();
     editorScroll();
-    struct abuf ab=ABUF_INIT;
+    long long td=editorProfNow();
+    editorDrawRows();
+    editorProfEnd(PROF_DRAW,td);
+    editorDrawStatusBar();
+    editorDrawMessageBar();
+
+    ab.len=0;
     abAppend(&ab,"\x1b[?25l",6);/* hide cursor */
+    int delta=E.rowoff-E.shadow_rowoff;
+    if(delta!=0 && delta<E.screenrows && -delta<E.screenrows) editorScrollShadow(&ab,delta);
+    E.shadow_rowoff=E.rowoff;
 
-    abAppend(&ab,"\x1b[H",3);
-    /* This escape sequence is only `3` bytes long, and uses the `H` command ([Cursor Position])to position the cursor. 
-    The `H` command actually takes two arguments: the row number and the column number at which to position the cursor. 
-    */
-    editorDrawRows(&ab);
-    editorDrawStatusBar(&ab);
-    editorDrawMessageBar(&ab);
+    int changed=(ab.len>6 || memcmp(E.frame,E.shadow,(E.screenrows+2)*E.screencols*sizeof(screenCell)));
+    if(!changed){
+        ab.len=0;
+    }else{
+        int cur=39;
+        int y;
+        for(y=0;y<E.screenrows+2;y++) editorFlushLine(&ab,y,&cur);
+        editorSetAttr(&ab,&cur,39);
+        screenCell* t=E.shadow;
+        E.shadow=E.frame;
+        E.frame=t;
+    }
 
     char buf[32];
-    snprintf(buf,sizeof(buf),"\x1b[%d;%dH",(E.cy-E.rowoff)+1,(E.rx-E.coloff)+1);
-    abAppend(&ab,buf,strlen(buf));
-
-    abAppend(&ab,"\x1b[?25h",6);/* reset cursor */
-
-    write(STDOUT_FILENO,ab.b,ab.len);
-    abFree(&ab);
+    int blen=snprintf(buf,sizeof(buf),"\x1b[%d;%dH%s",(E.cy-E.rowoff)+1,(E.rx-E.coloff)+1,
+    changed ? "\x1b[?25h" : "");/* put the cursor back and show it again */
+    /* The `H` command ([Cursor Position]) takes two arguments: 
+    the row number and the column number at which to position the cursor. */
+
+    struct iovec iov[2]={{ab.b,ab.len},{buf,blen}};
+    long long tw=editorProfNow();
+    writev(STDOUT_FILENO,iov,2);/* the whole frame in one system call */
+    editorProfEnd(PROF_WRITE,tw);
+    E.frame_bytes=ab.len+blen;
+    editorProfFrame(t);
 }
 void editorSetStatusMessage(const char* fmt,...){
     va_list ap;
@@ -897,7 +3756,7 @@ char* editorPrompt(char* prompt,void (*callback)(char*,int)){
 
     while(1){
         editorSetStatusMessage(prompt,buf);
-        editorRefreshScreen();
+        if(!editorInputWait(0)) editorRefreshScreen();/* no frames for keys that are already typed */
 
         int c=editorReadKey();
 
@@ -927,7 +3786,7 @@ char* editorPrompt(char* prompt,void (*callback)(char*,int)){
     }
 }
 void editorMoveCorsor(int key){
-    erow *row=(E.cy>=E.numrows) ? NULL : &E.row[E.cy];
+    erow *row=(E.cy>=E.numrows) ? NULL : editorRowAt(E.cy);
     switch (key)
     {
     case ARROW_LEFT:
@@ -935,7 +3794,7 @@ void editorMoveCorsor(int key){
             E.cx--;
         }else if(E.cy>0){
             E.cy--;
-            E.cx=E.row[E.cy].size;
+            E.cx=editorRowAt(E.cy)->size;
         }
         break;
     case ARROW_RIGHT:
@@ -958,7 +3817,7 @@ void editorMoveCorsor(int key){
         break;
     }
 
-    row=(E.cy>=E.numrows) ? NULL : &E.row[E.cy];
+    row=(E.cy>=E.numrows) ? NULL : editorRowAt(E.cy);
     int rowlen= row ? row->size : 0;
     if(E.cx>rowlen){
         E.cx=rowlen;
@@ -967,16 +3826,23 @@ void editorMoveCorsor(int key){
 void editorProcessKeypress(){
     static int quit_times=KILO_QUIT_TIMES;
     int c=editorReadKey();
+    long long t=editorProfNow();
+    int kind=0;
+    if(c==BACKSPACE || c==CTRL_KEY('h') || c==DEL_KEY) kind=2;
+    else if(c=='\t' || (!iscntrl(c) && c<1000)) kind=1;/* keys that end up in editorInsertChar() */
+    editorUndoBegin(kind);
     switch (c)
     {
     case '\r':
         editorInsertNewLine();
         break;
     case CTRL_KEY('q'):
+        editorSaveDone();/* a save in progress is seen through first */
         if(E.dirty && quit_times>0){
             editorSetStatusMessage("WARNING! File has unsaved changes. "
             "Press Ctrl-Q %d more times to quit.",quit_times);
             quit_times--;
+            editorProfEnd(PROF_KEY,t);
             return;
         }
         write(STDOUT_FILENO,"\x1b[2J",4);
@@ -984,18 +3850,37 @@ void editorProcessKeypress(){
         exit(0);
         break;
 
+    case PASTE_TEXT:
+        editorInsertText(E.paste,E.pastelen);
+        break;
     case CTRL_KEY('s'):
-        editorSave();
+        {
+            long long ts=editorProfNow();
+            editorSave();
+            editorProfEnd(PROF_SAVE,ts);
+        }
         break;
     case CTRL_KEY('f'):
         editorFind();
         break;
+    case CTRL_KEY('z'):
+        editorUndo();
+        break;
+    case CTRL_KEY('y'):
+        editorRedo();
+        break;
+    case CTRL_KEY('p'):
+        E.prof_overlay=!E.prof_overlay;
+        E.profiling=E.prof_overlay || E.trace_path;
+        E.prof_nframes=0;
+        E.prof_busy=0;
+        break;
     case HOME_KEY:
         E.cx=0;
         break;
     case END_KEY:
         if(E.cy<E.numrows){
-            E.cx=E.row[E.cy].size;
+            E.cx=editorRowAt(E.cy)->size;
         }
         break;
     
@@ -1045,6 +3930,8 @@ void editorProcessKeypress(){
     }
 
     quit_times=KILO_QUIT_TIMES;
+    editorScroll();/* rowoff follows every key, drawn or not: paging relies on it */
+    editorProfEnd(PROF_KEY,t);
 }
 
 /* ***init*** */
@@ -1055,27 +3942,137 @@ void initEditor(){
     E.rowoff=0;
     E.coloff=0;
     E.numrows=0;
-    E.row=NULL;
+    E.rows=ropeNewNode(1);
+    E.gaprow=-1;
+    E.hlck_cap=64;
+    E.hlck=malloc(E.hlck_cap);
+    E.hlck[0]=0;
+    E.hlck_valid=1;
+    E.map=NULL;
+    E.maplen=0;
     E.filename=NULL;
     E.dirty=0;
     E.statusmsg[0]='\0';
     E.statusmsg_time=0;
+    E.inlen=0;
+    E.inpos=0;
+    E.matches=NULL;
+    E.nmatches=0;
+    E.matchcap=0;
+    E.nfound=0;
+    E.match=-1;
+    E.matches_all=1;
+    E.query=NULL;
+    E.querylen=0;
+    E.search_regex=0;
+    E.search_bad=0;
+    E.paste=NULL;
+    E.pastelen=0;
+    E.pastecap=0;
+    E.undo=NULL;
+    E.undo_head=E.undo_cur=E.undo_n=E.undo_cap=0;
+    E.undo_arena=NULL;
+    E.undo_base=E.undo_end=0;
+    E.undo_arenacap=0;
+    char* undo_mb=getenv("KILO_UNDO_MB");
+    E.undo_limit=(long long)((undo_mb && atoi(undo_mb)>0) ? atoi(undo_mb) : KILO_UNDO_MB)<<20;
+    E.undo_step=-1;
+    E.undo_kind=0;
+    E.undo_cx=E.undo_cy=0;
+    E.undo_off=0;
+    E.saving=0;
+    E.save_rows=NULL;
+    E.save_garbage=NULL;
+    E.save_ngarbage=0;
+    E.save_garbagecap=0;
+    if(pipe(E.save_pipe)==-1) die("pipe");
+    E.loading=0;
+    E.load_ready=NULL;
+    E.load_nready=E.load_readycap=0;
+    E.load_bytes=0;
+    E.load_size=0;
+    E.load_scan=0;
+    E.paging=0;
+    E.page_fd=-1;
+    E.page_limit=0;
+    E.page_bytes=0;
+    E.page_newest=E.page_oldest=NULL;
+    E.page_hold=0;
+    E.page_keep=NULL;
+    E.page_garbage=NULL;
+    E.page_ngarbage=E.page_garbagecap=0;
+    pthread_mutex_init(&E.load_mutex,NULL);
+    if(pipe(E.load_pipe)==-1) die("pipe");
+    fcntl(E.load_pipe[0],F_SETFL,O_NONBLOCK);
     if(getWindowSize(&E.screenrows,&E.screencols)==-1) die("getWindowSize");
     E.screenrows-=2;
     E.syntax=NULL;
+    int cells=(E.screenrows+2)*E.screencols;
+    E.frame=malloc(cells*sizeof(screenCell));
+    E.shadow=malloc(cells*sizeof(screenCell));
+    memset(E.shadow,0,cells*sizeof(screenCell));/* matches no cell we draw, so the first frame is sent whole */
+    E.shadow_rowoff=0;
+    E.frame_bytes=0;
+    E.show_frame_bytes=getenv("KILO_FRAME_BYTES")!=NULL;
+    char* fps=getenv("KILO_MAX_FPS");
+    E.frame_ms=(fps && atoi(fps)>0) ? 1000/atoi(fps) : 0;
+    E.prof_overlay=0;
+    E.prof_busy=0;
+    E.prof_nframes=0;
+    E.trace=NULL;
+    E.ntrace=E.tracecap=0;
+    E.trace_dropped=0;
+    E.trace_path=getenv("KILO_TRACE");
+    E.profiling=E.trace_path!=NULL;
+    if(E.trace_path) atexit(editorTraceWrite);
+    for(unsigned int j=0;j<HLDB_ENTRIES;j++) editorSyntaxCompile(&HLDB[j]);
 }
 
+int editorParseArgs(int argc,char* argv[],long long* page_limit){
+    /* the index in argv of the file to open (argc for none), -1 if the arguments are wrong.
+    -m MB: files are paged in from disk, holding at most about MB of them in memory */
+    int arg=1;
+    *page_limit=0;
+    if(argc>1 && !strcmp(argv[1],"-m")){
+        if(argc<3) return -1;
+        char* end;
+        errno=0;
+        long long mb=strtoll(argv[2],&end,10);
+        if(end==argv[2] || *end || errno || mb<=0 || mb>(LLONG_MAX>>20)) return -1;
+        *page_limit=mb<<20;
+        arg=3;
+    }
+    return arg;
+}
 int main(int argc, char* argv[]){
+    long long page_limit;
+    int arg=editorParseArgs(argc,argv,&page_limit);
+    if(arg==-1){
+        fprintf(stderr,"usage: %s [-m MB] [file]\n",argv[0]);
+        return 1;
+    }
     enableRawMode();
     initEditor();
-    if(argc>=2){
-        editorOpen(argv[1]);
+    E.page_limit=page_limit;
+    if(argc>arg){
+        editorOpen(argv[arg]);
     }
-    editorSetStatusMessage("HELP: Ctrl-S=save | Ctrl-Q=quit | Ctrl-F=find");
+    editorSetStatusMessage("HELP: Ctrl-S=save | Ctrl-Q=quit | Ctrl-F=find | Ctrl-Z/Y=undo/redo");
 
     while(1){
+        editorPageCollect();/* between keys no row pointer is held */
+        editorLoadScan();
+        editorPageTrim();
         editorRefreshScreen();
+        long long last=editorMsNow();
         editorProcessKeypress();
+        /* apply every key that is already queued, or that comes in before the next frame is
+        due, and only then draw: frames nobody would get to see are skipped */
+        while(1){
+            int wait=E.frame_ms-(int)(editorMsNow()-last);
+            if(!editorInputWait(wait>0 ? wait : 0)) break;
+            editorProcessKeypress();
+        }
     }
     return 0;
 }
@@ -0,0 +1,286 @@
+/* checks of kilo's insides, for what a key script in bench/ can't see: a file is made and
+opened the way kilo would, then edited and saved to compare the file on disk with what it
+should be, or paged through to see -m keep to its limit. the command line is parsed first.
+prints a line per check, the exit status is 1 if any failed.
+
+    make test
+
+a saved file has \n line endings only: any \r before a newline is taken off a row when the
+file is split, and every row, edited or not, is written back with a bare \n. */
+
+/* ***includes*** */
+#define main kilo_main
+#include "../kilo.c"
+#undef main
+
+/* ***data*** */
+struct{
+    FILE* out;/* stdout is kilo's pseudo terminal, this is the real one */
+    char dir[64];
+    int failed;
+}T;
+
+/* ***checks*** */
+char* testExpect(char* s,long long len,int edit,long long* outlen){
+    /* what a save should give: the lines of s without the \r before their newline, a
+    newline after the last, and an x typed in front of row edit */
+    char* out=malloc(len*2+2);
+    long long n=0;
+    int row=0;
+    char* p=s;
+    char* end=s+len;
+    while(p<end){
+        char* nl=memchr(p,'\n',end-p);
+        if(!nl) nl=end;
+        long long linelen=nl-p;
+        while(linelen>0 && p[linelen-1]=='\r') linelen--;
+        if(row++==edit) out[n++]='x';
+        memcpy(out+n,p,linelen);
+        n+=linelen;
+        out[n++]='\n';
+        p=nl<end ? nl+1 : end;
+    }
+    *outlen=n;
+    return out;
+}
+void testSave(char* name,char* s,long long len,int mb,int edit){
+    char path[128];
+    snprintf(path,sizeof(path),"%s/%s",T.dir,name);
+    FILE* fp=fopen(path,"w");
+    if(!fp || fwrite(s,1,len,fp)!=(size_t)len || fclose(fp)!=0) die(path);
+
+    initEditor();
+    E.page_limit=(long long)mb<<20;
+    editorOpen(path);
+    editorLoadFinish();
+    E.cy=edit;
+    E.cx=0;
+    editorInsertChar('x');
+    editorSave();
+    editorSaveDone();
+    if(E.paging) close(E.page_fd);
+    else if(E.map) munmap(E.map,E.maplen);
+
+    long long wantlen;
+    char* want=testExpect(s,len,edit,&wantlen);
+    char* got=malloc(wantlen+1);
+    fp=fopen(path,"r");
+    long long gotlen=fp ? (long long)fread(got,1,wantlen+1,fp) : -1;
+    if(fp) fclose(fp);
+    long long at=0;
+    while(at<gotlen && at<wantlen && got[at]==want[at]) at++;
+    int ok=gotlen==wantlen && at==wantlen;
+    if(!ok) T.failed=1;
+    fprintf(T.out,"%-24s %s",name,ok ? "ok" : "FAILED");
+    if(!ok) fprintf(T.out,", %lld bytes, %lld wanted, first difference at %lld",gotlen,wantlen,at);
+    fprintf(T.out,"%s\n",mb ? " (-m)" : "");
+    unlink(path);
+    free(want);
+    free(got);
+}
+char* testLines(int n,char* eol,long long* len){/* "line N" and eol, n times */
+    char* s=malloc((long long)n*(16+strlen(eol)));
+    *len=0;
+    for(int j=0;j<n;j++) *len+=sprintf(s+*len,"line %d%s",j,eol);
+    return s;
+}
+void testCrlf(){
+    long long len;
+    char* s=testLines(1000,"\r\n",&len);
+    /* a row in the middle: the pages before and after it are copied from the file */
+    testSave("crlf.txt",s,len,1,500);
+    testSave("crlf.txt",s,len,0,500);
+    free(s);
+
+    s=testLines(1000,"\n",&len);
+    testSave("lf.txt",s,len,1,500);
+    free(s);
+
+    /* \r\n and \n mixed, a \r of its own in a line, and a last line ending in \r only */
+    char* mixed=malloc(64*1000);
+    len=0;
+    for(int j=0;j<1000;j++){
+        len+=sprintf(mixed+len,"line %d%s",j,j%3==0 ? "\r\n" : j%3==1 ? "\n" : "\rmore\r\r\n");
+    }
+    len+=sprintf(mixed+len,"last\r");
+    testSave("mixed.txt",mixed,len,1,10);
+    testSave("mixed.txt",mixed,len,0,10);
+    strcpy(mixed+len-5,"\r");/* "last\r" becomes a line that is just \r */
+    testSave("mixed-end.txt",mixed,len-4,1,0);
+
+    /* pages are copied KILO_PAGE_READ bytes at a time: a \r\n and a lone \r split by where
+    one read ends. the last row is the one edited, so the copy starts at 0 */
+    long long big=KILO_PAGE_READ*3;
+    s=malloc(big);
+    memset(s,'a',big);
+    for(long long j=99;j<big;j+=100) s[j]='\n';
+    s[KILO_PAGE_READ-2]='\r';
+    s[KILO_PAGE_READ-1]='\r';
+    s[KILO_PAGE_READ]='\n';
+    s[2*KILO_PAGE_READ-1]='\r';
+    s[2*KILO_PAGE_READ]='b';
+    int rows=0;
+    for(long long j=0;j<big;j++) rows+=s[j]=='\n';
+    testSave("crlf-split.txt",s,big,1,rows-1);
+    free(s);
+    free(mixed);
+}
+void testPageBytes(){
+    /* every row of a file four times the -m limit is drawn, tabs and highlighting and all:
+    E.page_bytes has to be what the pages read in really hold, and stay under the limit */
+    char path[128];
+    snprintf(path,sizeof(path),"%s/paged.c",T.dir);
+    FILE* fp=fopen(path,"w");
+    if(!fp) die(path);
+    for(int j=0;j<80000;j++) fprintf(fp,"\tint x%d=%d;\t/* line\t%d */\n",j,j*7,j);
+    if(fclose(fp)!=0) die(path);
+
+    initEditor();
+    E.page_limit=1<<20;
+    editorOpen(path);
+    editorLoadFinish();
+    for(int j=0;j<E.numrows;j++){
+        erow* row=editorRowAt(j);
+        editorRowCxToRx(row,row->size);
+        editorUpdateSyntax(j);
+        if(j%1000==0) editorPageTrim();
+    }
+    editorPageTrim();
+    long long held=0;
+    for(ropeNode* leaf=E.page_newest;leaf;leaf=leaf->older) held+=leaf->len+sizeof(erow)*ROPE_LEAF_ROWS+editorPageExtra(leaf);
+    int ok=held==E.page_bytes && E.page_bytes<=E.page_limit;
+    if(!ok) T.failed=1;
+    fprintf(T.out,"%-24s %s, %lld bytes counted, %lld held, limit %lld (-m)\n","paged.c",ok ? "ok" : "FAILED",
+        E.page_bytes,held,E.page_limit);
+    close(E.page_fd);
+    unlink(path);
+}
+void testLongLines(){
+    /* one page of lines this long is over the -m limit by itself: the comment state walk
+    that runs while a row is made ready to draw must not drop that row's page under it */
+    char path[128];
+    snprintf(path,sizeof(path),"%s/long.c",T.dir);
+    FILE* fp=fopen(path,"w");
+    if(!fp) die(path);
+    for(int j=0;j<200;j++){
+        fprintf(fp,"int line%d;",j);
+        for(int k=0;k<36*1024;k++) fputc('a'+k%26,fp);
+        fputc('\n',fp);
+    }
+    if(fclose(fp)!=0) die(path);
+
+    initEditor();
+    E.page_limit=1<<20;
+    editorOpen(path);
+    editorLoadFinish();
+    int blank=0,drawn=0;
+    int rowoffs[]={0,100,170};
+    for(int k=0;k<3;k++){
+        E.rowoff=rowoffs[k];
+        editorDrawRows();
+        for(int y=0;y<E.screenrows && y+E.rowoff<E.numrows;y++){
+            char want[32];
+            int n=sprintf(want,"int line%d;a",y+E.rowoff);
+            int j;
+            for(j=0;j<n && E.frame[y*E.screencols+j].c==want[j];j++);
+            if(j<n) blank++;
+            drawn++;
+        }
+    }
+    int ok=blank==0;
+    if(!ok) T.failed=1;
+    fprintf(T.out,"%-24s %s, %d of %d rows drawn wrong (-m)\n","long.c",ok ? "ok" : "FAILED",blank,drawn);
+    close(E.page_fd);
+    unlink(path);
+}
+void testMapped(){
+    /* a mapped file only gets rows where it is looked at: the first screen makes the rows of
+    a page or two. a jump to the end scans the comment state on worker threads, every row
+    drawn there has to be the right line */
+    char path[128];
+    snprintf(path,sizeof(path),"%s/mapped.c",T.dir);
+    FILE* fp=fopen(path,"w");
+    if(!fp) die(path);
+    for(int j=0;j<80000;j++) fprintf(fp,"int x%d;%s\n",j,j%1000==0 ? " /* open" : j%1000==500 ? " close */" : "");
+    if(fclose(fp)!=0) die(path);
+
+    initEditor();
+    editorOpen(path);
+    editorLoadFinish();
+    E.rowoff=0;
+    editorDrawRows();
+    int leaves=0,built=0;
+    for(int j=0;j<E.numrows;){
+        ropeNode* leaf=editorRowLeaf(j);
+        leaves++;
+        built+=leaf->row!=NULL;
+        j+=leaf->n;
+    }
+    int wrong=0;
+    E.rowoff=E.numrows-E.screenrows;
+    editorDrawRows();
+    for(int y=0;y<E.screenrows;y++){
+        char want[32];
+        int n=sprintf(want,"int x%d;",y+E.rowoff);
+        int j;
+        for(j=0;j<n && E.frame[y*E.screencols+j].c==want[j];j++);
+        if(j<n) wrong++;
+    }
+    int ok=E.map && built<=2 && wrong==0;
+    if(!ok) T.failed=1;
+    fprintf(T.out,"%-24s %s, %d of %d leaves built for the first screen, %d rows drawn wrong\n","mapped.c",
+        ok ? "ok" : "FAILED",built,leaves,wrong);
+    munmap(E.map,E.maplen);
+    unlink(path);
+}
+void testArgs(){
+    /* -m takes a positive whole number of MB, anything else is a usage error and not a file */
+    struct{char* argv[4];int argc,want;long long limit;}c[]={
+        {{"kilo","file.c"},2,1,0},
+        {{"kilo"},1,1,0},
+        {{"kilo","-m","64","file.c"},4,3,64LL<<20},
+        {{"kilo","-m","1"},3,3,1LL<<20},
+        {{"kilo","-m","file.c"},3,-1,0},
+        {{"kilo","-m"},2,-1,0},
+        {{"kilo","-m","abc","file.c"},4,-1,0},
+        {{"kilo","-m","12x","file.c"},4,-1,0},
+        {{"kilo","-m","0","file.c"},4,-1,0},
+        {{"kilo","-m","-5","file.c"},4,-1,0},
+        {{"kilo","-m","99999999999999999999","file.c"},4,-1,0},
+    };
+    for(unsigned j=0;j<sizeof(c)/sizeof(c[0]);j++){
+        long long limit=-1;
+        int got=editorParseArgs(c[j].argc,c[j].argv,&limit);
+        int ok=got==c[j].want && (got==-1 || limit==c[j].limit);
+        if(!ok) T.failed=1;
+        char line[128]="kilo";
+        for(int k=1;k<c[j].argc;k++) snprintf(line+strlen(line),sizeof(line)-strlen(line)," %s",c[j].argv[k]);
+        fprintf(T.out,"%-24s %s",line,ok ? "ok" : "FAILED");
+        if(!ok) fprintf(T.out,", argv index %d, %d wanted, limit %lld",got,c[j].want,limit);
+        fprintf(T.out,"\n");
+    }
+}
+
+int main(){
+    T.out=fdopen(dup(STDOUT_FILENO),"w");
+    int master=posix_openpt(O_RDWR|O_NOCTTY);
+    if(master==-1 || grantpt(master)==-1 || unlockpt(master)==-1) die("posix_openpt");
+    int slave=open(ptsname(master),O_RDWR|O_NOCTTY);
+    if(slave==-1) die("ptsname");
+    struct winsize ws={24,80,0,0};
+    if(ioctl(slave,TIOCSWINSZ,&ws)==-1) die("TIOCSWINSZ");
+    dup2(slave,STDOUT_FILENO);/* for getWindowSize(), nothing is drawn */
+    close(slave);
+    strcpy(T.dir,"/tmp/kilo-test-XXXXXX");
+    if(!mkdtemp(T.dir)) die("mkdtemp");
+
+    testArgs();
+    testCrlf();
+    testPageBytes();
+    testLongLines();
+    testMapped();
+
+    rmdir(T.dir);
+    fclose(T.out);
+    return T.failed;
+}